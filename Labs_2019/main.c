@@ -7,8 +7,27 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <sys/resource.h>
+
+#include "../vproc.h"
+#include "../trace.h"
 
 #define LIFETIME 5
+#define MAX_CHILDREN 131072
+#define CACHE_LINE 64
+
+// Tick modes (F argument): every tick signals whole group (N^2 deliveries),
+// or bumps a shared counter, optionally with futex notification of the
+// first W children (watchers)
+
+#define TICK_SIGNAL 0
+#define TICK_COUNTER 1
+#define TICK_NOTIFY 2
 #define ERR(source) (fprintf(stderr,"%s:%d\n",__FILE__,__LINE__),\
                      perror(source),kill(0,SIGKILL),\
                      exit(EXIT_FAILURE))
@@ -18,97 +37,324 @@
 volatile sig_atomic_t i = 0;
 
 void sigusr_handler(int sig) {
+    trace_signal(sig);
     i++;
 }
 
-int child_work() {
-    signal(SIGUSR1, sigusr_handler);
+// Result of one child, each on its own cache line so children don't share them
+
+struct result {
+    pid_t pid;
+    int k;
+    long long i;
+    long long start_ns;
+    long long end_ns;
+} __attribute__((aligned(CACHE_LINE)));
+
+// Shared table (MAP_SHARED, inherited by children): number of completed
+// children is also the futex word parent sleeps on, bitmap tells which
+// slots are complete and not yet printed
+
+struct result_table {
+    _Atomic unsigned int ticks __attribute__((aligned(CACHE_LINE)));
+    _Atomic unsigned int watchers __attribute__((aligned(CACHE_LINE)));
+    _Atomic unsigned int done __attribute__((aligned(CACHE_LINE)));
+    _Atomic uint64_t bitmap[(MAX_CHILDREN + 63) / 64] __attribute__((aligned(CACHE_LINE)));
+    struct result results[MAX_CHILDREN];
+};
+
+struct result_table * table;
+int tick_mode = TICK_SIGNAL;
+int watch_count = 1;
+
+// Virtual time under VTIME
+
+long long now_ns() {
+    return vp_now();
+}
+
+// FUTEX_WAIT or FUTEX_WAKE, through the engine when children are virtual
+
+int futex(_Atomic unsigned int * uaddr, int op, unsigned int val, const struct timespec * timeout) {
+    if (op == FUTEX_WAIT)
+        return vp_futex_wait(uaddr, val, timeout);
+    return vp_futex_wake(uaddr, val);
+}
+
+// Shared counter version of the child: a tick is one atomic increment,
+// nobody is interrupted, so cost is O(N) instead of O(N^2). Child learns
+// how many ticks everyone emitted while it lived from counter difference.
+// With notification watchers (opt-in, first W children) sleep on the
+// counter and see every tick live. They register before sleeping and a
+// tick calls FUTEX_WAKE only while someone is registered, so the cost is
+// O(N + W * ticks), not N wake-ups per tick
+
+void counter_child_work(int k, int slot) {
+    unsigned int start = atomic_load(&table->ticks);
+    int watch = tick_mode == TICK_NOTIFY && slot < watch_count;
+    int seconds = 0;
+
+    while(seconds < k) {
+        vp_sleep(1);
+        seconds++;
+        atomic_fetch_add(&table->ticks, 1);
+        if (tick_mode == TICK_NOTIFY && atomic_load(&table->watchers))
+            futex(&table->ticks, FUTEX_WAKE, INT_MAX, NULL);
+    }
+
+    long long deadline = now_ns() + (LIFETIME - k) * 1000000000LL;
+    long long left;
+
+    while ((left = deadline - now_ns()) > 0) {
+        struct timespec t = {left / 1000000000LL, left % 1000000000LL};
+        if (watch) {
+
+            // A tick between the load and registering makes FUTEX_WAIT return at once
+
+            unsigned int seen = atomic_load(&table->ticks);
+            atomic_fetch_add(&table->watchers, 1);
+            futex(&table->ticks, FUTEX_WAIT, seen, &t);
+            atomic_fetch_sub(&table->watchers, 1);
+        } else {
+            vp_nanosleep(&t, NULL);
+        }
+    }
+
+    i = atomic_load(&table->ticks) - start;
+}
+
+void child_work(int slot) {
+    vp_signal(SIGUSR1, sigusr_handler);
+    struct result * r = &table->results[slot];
+    r->start_ns = now_ns();
   
     // Getting amount of seconds for which we wait...
 
-    srand(getpid());
+    srand(vp_getpid());
     int k = rand()%(LIFETIME+1);
     int seconds = 0;
   
     // ...and waiting
 
-    while(seconds < k) {
-        sleep(1);
-        seconds++;
-        kill(0, SIGUSR1);
-    }
+    if (tick_mode != TICK_SIGNAL) {
+        counter_child_work(k, slot);
+    } else {
+        while(seconds < k) {
+            vp_sleep(1);
+            seconds++;
+            trace_kill(0, SIGUSR1);
+            vp_kill(0, SIGUSR1);
+        }
   
-    // After we're finished we're waiting for (10 - waited) more seconds
+        // After we're finished we're waiting for (10 - waited) more seconds
 
-    do {
-        seconds = sleep(LIFETIME - k);
-    } while (seconds > 0);
+        do {
+            seconds = vp_sleep(LIFETIME - k);
+        } while (seconds > 0);
+    }
 
-    fprintf(stdout, "[%d] K=%d\ti=%d\n", getpid(), k, i);
+    fprintf(stdout, "[%d] K=%d\ti=%d\n", vp_getpid(), k, i);
   
-    // We're operating on bits here, it's pretty fucked up
+    // Publishing full-width result in our slot, then marking it complete
+    // (release, so parent sees the fields) and waking parent up
+
+    r->pid = vp_getpid();
+    r->k = k;
+    r->i = i;
+    r->end_ns = now_ns();
 
-    unsigned int compound = 0;
-    compound |= i;
-    compound |= (k << 4);
-    return compound;
+    atomic_fetch_or(&table->bitmap[slot / 64], 1ULL << (slot % 64));
+    atomic_fetch_add(&table->done, 1);
+    futex(&table->done, FUTEX_WAKE, 1, NULL);
 }
 
-// Creation of n child processes
+void child_start(void *arg) {
+    child_work((int)(intptr_t)arg);
+}
+
+// Creation of n child processes, coroutines when VPROC is set
 
 void create_children(int n) {
-    for (int i = 1; i <= n; i++) {
-        int x;
-        switch (fork()) {
+    for (int i = 0; i < n; i++) {
+        if (vp_active()) {
+            vp_spawn(child_start, (void *)(intptr_t)i);
+            continue;
+        }
+        pid_t pid;
+        switch (pid = fork()) {
             case 0:
-                x = child_work();
-                exit(x);
+                child_work(i);
+                exit(EXIT_SUCCESS);
             case -1:
                 perror("fork");
                 exit(EXIT_FAILURE);
         }
+        trace_fork(pid);
     }
 }
 
-// Parent will basically work for kid now
-
-void parent_work() {
-    while (1) {
-        int status;
-        pid_t p = waitpid(0, &status, WNOHANG);
-        if(p > 0) {
-            unsigned int exit_status = WEXITSTATUS(status);
-          
-            // Getting data from binary variable we created before
-            
-            int I = (exit_status & 0x0F);
-            int k = (exit_status & 0xF0) >> 4;
-          
-            fprintf(stdout, "(%d,%d,%d)", p, k, I);
+// Parent sleeps on the futex until some child completes, then takes all
+// completed slots from the bitmap at once. Children are reaped as they
+// exit (their results are already in the table), so once all of them are
+// gone and nothing new came, the rest died without reporting. Timeout only
+// guards against that case
+
+void parent_work(int n) {
+    int printed = 0, reaped = 0, status;
+    unsigned int seen = 0;
+    struct timespec timeout = {1, 0};
+    pid_t pid;
+
+    while (printed < n) {
+        if (vp_active()) {
+            if (vp_wait(NULL) < 0 && errno == ECHILD)
+                break;
+        } else if (atomic_load(&table->done) == seen) {
+            futex(&table->done, FUTEX_WAIT, seen, &timeout);
         }
-        if (p < 0 && errno == ECHILD)
+        seen = atomic_load(&table->done);
+
+        for (int w = 0; w < (n + 63) / 64; w++) {
+            uint64_t bits = atomic_exchange(&table->bitmap[w], 0);
+            while (bits) {
+                int slot = w * 64 + __builtin_ctzll(bits);
+                struct result * r = &table->results[slot];
+                fprintf(stdout, "(%d,%d,%lld)", r->pid, r->k, r->i);
+                bits &= bits - 1;
+                printed++;
+            }
+        }
+
+        if (vp_active())
+            continue;
+
+        while ((pid = waitpid(0, &status, WNOHANG)) > 0) {
+            trace_reap(pid, status);
+            reaped++;
+        }
+
+        if (pid < 0 && errno != ECHILD)
+            ERR("waitpid");
+
+        if (printed < n && reaped == n && seen == atomic_load(&table->done))
             break;
     }
 }
 
+void run(int n) {
+    vp_signal(SIGUSR1, SIG_IGN);
+
+    create_children(n);
+    parent_work(n);
+
+    pid_t pid;
+    int status;
+    while((pid = vp_wait(&status)) > 0)
+        trace_reap(pid, status);
+    fprintf(stdout, "\n");
+}
+
+// Runs every N in 10..max_n with signals, shared counter and counter with
+// notification (W watchers as given, 1 by default). Each run
+// is a separate process group (kill(0) must not hit us) with output thrown
+// away, cost of the whole tree comes from RUSAGE_CHILDREN
+
+void bench(int max_n) {
+    int steps[] = {10, 30, 100, 300, 1000};
+    int modes[] = {TICK_SIGNAL, TICK_COUNTER, TICK_NOTIFY};
+    char * names[] = {"signal", "counter", "notify"};
+
+    printf("%5s %8s %8s %8s %10s %10s %12s\n", "N", "mode", "wall s", "cpu s", "vol cs", "invol cs", "ticks seen");
+
+    for (int s = 0; s < 5 && steps[s] <= max_n; s++) {
+        for (int m = 0; m < 3; m++) {
+            struct rusage before, after;
+            long long start = now_ns();
+            pid_t pid;
+
+            memset(table, 0, sizeof(struct result_table));
+            tick_mode = modes[m];
+            getrusage(RUSAGE_CHILDREN, &before);
+            fflush(stdout);
+
+            switch (pid = fork()) {
+                case 0:
+                    setpgid(0, 0);
+                    if (!freopen("/dev/null", "w", stdout))
+                        ERR("freopen");
+                    run(steps[s]);
+                    exit(EXIT_SUCCESS);
+                case -1:
+                    ERR("fork");
+            }
+
+            if (waitpid(pid, NULL, 0) < 0)
+                ERR("waitpid");
+            getrusage(RUSAGE_CHILDREN, &after);
+
+            long long seen = 0;
+            for (int c = 0; c < steps[s]; c++)
+                seen += table->results[c].i;
+
+            double cpu = after.ru_utime.tv_sec - before.ru_utime.tv_sec + after.ru_stime.tv_sec - before.ru_stime.tv_sec
+                       + (after.ru_utime.tv_usec - before.ru_utime.tv_usec + after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1e6;
+
+            printf("%5d %8s %8.2f %8.3f %10ld %10ld %12lld\n", steps[s], names[m],
+                   (now_ns() - start) / 1e9, cpu, after.ru_nvcsw - before.ru_nvcsw,
+                   after.ru_nivcsw - before.ru_nivcsw, seen);
+        }
+    }
+}
+
 void usage(char *name) {
-    fprintf(stderr, "USAGE: %s N F\n", name);
-    fprintf(stderr, "N - number of children [1,100]\n");
+    fprintf(stderr, "USAGE: %s N [F [W]]\n", name);
+    fprintf(stderr, "N - number of children [1,%d], above a few thousand only with VPROC set\n", MAX_CHILDREN);
+    fprintf(stderr, "F - ticks: 0 kill(0, SIGUSR1) (default), 1 shared counter, 2 shared counter + futex notification,\n");
+    fprintf(stderr, "    bench - compare 0, 1 and 2 for N = 10..N\n");
+    fprintf(stderr, "W - with F = 2 or bench: number of children watching ticks live (default 1)\n");
     exit(EXIT_FAILURE);
 }
 
 int main(int argc, char** argv) {
-    if (argc != 2) {
+    if (argc < 2 || argc > 4) {
         usage(argv[0]);
     }
 
     int n = atoi(argv[1]);
+    if (n < 1 || n > MAX_CHILDREN) {
+        usage(argv[0]);
+    }
+
+    if (argc == 4 && ((watch_count = atoi(argv[3])) < 0 || watch_count > n)) {
+        usage(argv[0]);
+    }
 
-    signal(SIGUSR1, SIG_IGN);
+    // Virtual processes (VPROC or VTIME set): children are coroutines, each
+    // one with its own i
 
-    create_children(n);
-    parent_work();
+    if (vp_enabled() && (argc == 2 || strcmp(argv[2], "bench"))) {
+        vp_private((void *)&i, sizeof(i));
+        vp_init();
+    }
 
-    while(wait(NULL) > 0);
-    fprintf(stdout, "\n");
+    // Binary event trace, only with TRACE set (see trace.h)
+
+    trace_init();
+
+    table = mmap(NULL, sizeof(struct result_table), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED)
+        ERR("mmap");
+
+    if (argc >= 3 && !strcmp(argv[2], "bench")) {
+        bench(n);
+    } else {
+        if (argc >= 3) {
+            tick_mode = atoi(argv[2]);
+            if (tick_mode < TICK_SIGNAL || tick_mode > TICK_NOTIFY)
+                usage(argv[0]);
+        }
+        run(n);
+    }
+
+    munmap(table, sizeof(struct result_table));
 }
@@ -9,6 +9,9 @@
 #include <string.h>
 #include <time.h>
 
+#include "../pacing.h"
+#include "../trace.h"
+
 #define ERR(source) (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
                     perror(source), kill(0, SIGKILL), \
                     exit(EXIT_FAILURE))
@@ -41,6 +44,7 @@ void setHandler(void (*f)(int), int sigNo) {
 // Function handling given signal
 
 void sig_handler(int sig) {
+    trace_signal(sig);
     last_signal = sig;
 }
 
@@ -57,6 +61,10 @@ void sigchld_handler(int sig) {
 
         pid = waitpid(0, NULL, WNOHANG);
 
+        if (pid > 0) {
+            trace_reap(pid, 0);
+        }
+
         // In case we can't get process status
 
         if (pid == 0) {
@@ -92,7 +100,9 @@ void child_work(int number) {
     // Generating pseudorandom number in [5, 10] range
 
     int t = rand() % (number);
-    struct timespec time = {0, t * 100};
+    struct pacer pc;
+
+    pacer_init(&pc, t * 100);
 
     // Function sending p SIGUSR1 signals
 
@@ -100,21 +110,29 @@ void child_work(int number) {
 
     for (int i = 0; i < t; i++) {
 
-        // Nanosleep handles delays
+        // Pacing engine handles delays
 
-        nanosleep(&time, NULL);
+        pacer_wait(&pc);
 
         // Sending SIGUSR1 to parent and checking if everything went fine
 
+        trace_kill(getppid(), SIGUSR1);
+
         if (kill(getppid(), SIGUSR1)) {
             ERR("kill");
-        } 
+        }
+    }
+
+    if (pc.verbose) {
+        pacer_report(&pc);
     }
 }
 
 void create_children(char ** argv, int argc) {
+    pid_t pid;
+
     for (int i = 2; i < argc; i++) {
-        switch(fork()) {
+        switch(pid = fork()) {
             case 0:
                 child_work(atoi(argv[i]));
                 // fprintf(stdout, "[%d] terminating\n", getpid());
@@ -124,6 +142,8 @@ void create_children(char ** argv, int argc) {
                 perror("fork");
                 exit(EXIT_FAILURE);
         }
+
+        trace_fork(pid);
     }
 }
 
@@ -163,10 +183,19 @@ int main(int argc, char ** argv) {
     // setHandler(SIG_IGN, SIGUSR2);
     setHandler(sigchld_handler, SIGCHLD);
 
+    // Binary event trace, only with TRACE set (see trace.h)
+
+    trace_init();
+
     create_children(argv, argc);
     // parent_work();
 
-    while(wait(NULL) > 0);
+    pid_t pid;
+    int status;
+
+    while((pid = wait(&status)) > 0) {
+        trace_reap(pid, status);
+    }
 
     return EXIT_SUCCESS;
 
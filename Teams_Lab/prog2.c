@@ -9,13 +9,28 @@
 #include <string.h>
 #include <time.h>
 
+#include "../pacing.h"
+#include "../shmring.h"
+#include "../trace.h"
+
 #define ERR(source) (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
                     perror(source), kill(0, SIGKILL), \
                     exit(EXIT_FAILURE))
 
 
+#define RING_CAPACITY 4096
+#define RING_PUSH 64
+
 volatile sig_atomic_t last_signal = 0;
 
+// RING transport: one ring per child, burst < 0 means signals,
+// 0 paced records in place of signals, > 0 records per child unpaced
+
+struct ring ** rings = NULL;
+long long ring_burst = -1;
+uint64_t * ring_next = NULL;
+long long ring_gaps = 0;
+
 void setHandler(void (*f)(int), int sigNo) {
 
     // This structure specifies how to handle a signal
@@ -41,6 +56,7 @@ void setHandler(void (*f)(int), int sigNo) {
 // Function handling given signal
 
 void sig_handler(int sig) {
+    trace_signal(sig);
     last_signal = sig;
     // fprintf(stdout, "*");
 }
@@ -58,6 +74,10 @@ void sigchld_handler(int sig) {
 
         pid = waitpid(0, NULL, WNOHANG);
 
+        if (pid > 0) {
+            trace_reap(pid, 0);
+        }
+
         // In case we can't get process status
 
         if (pid == 0) {
@@ -84,7 +104,37 @@ void usage(char * name) {
 
 // Function assigning tasks to processes
 
-void child_work(int number) {
+// Records in place of signals, pushed in batches when unpaced
+
+void child_ring_work(struct ring * r, int number, int t, struct pacer * pc) {
+
+    struct ring_rec recs[RING_PUSH];
+    long long count = ring_burst > 0 ? ring_burst : t;
+    int32_t pid = getpid();
+    int k = 0;
+
+    for (long long i = 0; i < count; i++) {
+
+        recs[k].pid = pid;
+        recs[k].seq = i;
+        recs[k].len = snprintf(recs[k].payload, RING_PAYLOAD, "Ni: %d, record %lld", number, i);
+
+        if (++k < RING_PUSH && ring_burst > 0 && i + 1 < count) {
+            continue;
+        }
+
+        if (!ring_burst) {
+            pacer_wait(pc);
+        }
+
+        ring_push_batch(r, recs, k);
+        k = 0;
+    }
+
+    ring_close(r);
+}
+
+void child_work(int number, int index) {
 
     // Providing seed to the random number generator
 
@@ -93,31 +143,46 @@ void child_work(int number) {
     // Generating pseudorandom number in [5, 10] range
 
     int t = rand() % (number);
-    struct timespec time = {0, t * 100};
+    struct pacer pc;
+
+    pacer_init(&pc, t * 100);
 
     // Function sending p SIGUSR1 signals
 
     printf("Ni: %d, C: %d\n", number, t);
 
+    if (rings) {
+        child_ring_work(rings[index], number, t, &pc);
+        return;
+    }
+
     for (int i = 0; i < t; i++) {
 
-        // Nanosleep handles delays
+        // Pacing engine handles delays
 
-        nanosleep(&time, NULL);
+        pacer_wait(&pc);
 
         // Sending SIGUSR1 to parent and checking if everything went fine
 
+        trace_kill(getppid(), SIGUSR1);
+
         if (kill(getppid(), SIGUSR1)) {
             ERR("kill");
         }
     }
+
+    if (pc.verbose) {
+        pacer_report(&pc);
+    }
 }
 
 void create_children(char ** argv, int argc) {
+    pid_t pid;
+
     for (int i = 2; i < argc; i++) {
-        switch(fork()) {
+        switch(pid = fork()) {
             case 0:
-                child_work(atoi(argv[i]));
+                child_work(atoi(argv[i]), i - 2);
                 // fprintf(stdout, "[%d] terminating\n", getpid());
                 exit(EXIT_SUCCESS);
 
@@ -125,6 +190,14 @@ void create_children(char ** argv, int argc) {
                 perror("fork");
                 exit(EXIT_FAILURE);
         }
+
+        trace_fork(pid);
+
+        // Parent stops waiting on the ring of a child that died without closing it
+
+        if (rings && ring_watch(rings[i - 2], pid) < 0) {
+            perror("pidfd_open");
+        }
     }
 }
 
@@ -141,6 +214,68 @@ void parent_work() {
     }
 }
 
+// Checks sequence of every child, a '*' per record when paced like per signal
+
+void ring_handle(int index, struct ring_rec * recs, int count) {
+
+    for (int i = 0; i < count; i++) {
+
+        if (recs[i].seq != ring_next[index]) {
+            ring_gaps++;
+        }
+
+        ring_next[index] = recs[i].seq + 1;
+
+        if (!ring_burst) {
+            fputc('*', stdout);
+        }
+    }
+}
+
+void parent_ring_work(int children) {
+
+    struct ring_stats st;
+    struct timespec start, end;
+    double s;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ring_consume(rings, children, ring_handle, &st);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    s = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fflush(stdout);
+    fprintf(stderr, "\n[ring] %lld records from %d children in %.3f s (%.2f M/s), %.1f per batch, "
+            "%lld sleeps, %lld sequence gaps\n", st.records, children, s, s > 0 ? st.records / s / 1e6 : 0.0,
+            st.batches ? (double) st.records / st.batches : 0.0, st.sleeps, ring_gaps);
+}
+
+// RING=paced or RING=<records per child>, rings are shared with children through fork
+
+void ring_setup(int children) {
+
+    char * env = getenv("RING");
+
+    if (!env) {
+        return;
+    }
+
+    ring_burst = strcmp(env, "paced") ? atoll(env) : 0;
+
+    if (ring_burst < 0) {
+        ring_burst = 0;
+    }
+
+    if (!(rings = calloc(children, sizeof(struct ring *))) || !(ring_next = calloc(children, sizeof(uint64_t)))) {
+        ERR("calloc");
+    }
+
+    for (int i = 0; i < children; i++) {
+        if (!(rings[i] = ring_create(RING_CAPACITY))) {
+            ERR("ring_create");
+        }
+    }
+}
+
 int main(int argc, char ** argv) {
 
     char * name;
@@ -157,10 +292,25 @@ int main(int argc, char ** argv) {
     // setHandler(SIG_IGN, SIGUSR2);
     signal(SIGCHLD, sigchld_handler);
 
+    // Binary event trace, only with TRACE set (see trace.h)
+
+    trace_init();
+
+    ring_setup(argc - 2);
     create_children(argv, argc);
-    parent_work();
 
-    while(wait(NULL) > 0);
+    if (rings) {
+        parent_ring_work(argc - 2);
+    } else {
+        parent_work();
+    }
+
+    pid_t pid;
+    int status;
+
+    while((pid = wait(&status)) > 0) {
+        trace_reap(pid, status);
+    }
 
     return EXIT_SUCCESS;
 
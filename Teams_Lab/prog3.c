@@ -10,6 +10,13 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "../pacing.h"
+#include "../trace.h"
 
 #define ERR(source) (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
                     perror(source), kill(0, SIGKILL), \
@@ -18,6 +25,31 @@
 
 volatile sig_atomic_t last_signal = 0;
 
+// Shared append mode, APPEND=mmap environment variable. The output file is
+// mapped MAP_SHARED before fork and children write their records straight
+// into it: a record is reserved with one atomic fetch_add on the shared
+// tail, so appends never wait for each other. The file grows in
+// APPEND_CHUNK steps under a process-shared mutex only when a reservation
+// crosses its end, parent just waits and truncates the file to the tail.
+// The mutex is robust, a child dying while growing doesn't block the rest.
+// A child dying between reserving a record and filling it leaves a
+// RECORD_SIZE hole of NULs (ftruncate zero-fills) in the file, nobody else
+// ever writes there.
+
+#define RECORD_SIZE 100
+#define APPEND_CHUNK (64 * 1024 * 1024)
+#define APPEND_WINDOW (1ULL << 36)
+
+struct append_region {
+    _Atomic uint64_t tail __attribute__((aligned(64)));
+    _Atomic uint64_t size __attribute__((aligned(64)));
+    pthread_mutex_t grow;
+};
+
+struct append_region * region = NULL;
+char * region_data = NULL;
+int region_fd = -1;
+
 // This handler for some reason doesn't work
 
 void setHandler(void (*f)(int), int sigNo) {
@@ -45,6 +77,7 @@ void setHandler(void (*f)(int), int sigNo) {
 // Function handling given signal
 
 void sig_handler(int sig) {
+    trace_signal(sig);
     last_signal = sig;
     fprintf(stdout, "*");
 }
@@ -62,6 +95,10 @@ void sigchld_handler(int sig) {
 
         pid = waitpid(0, NULL, WNOHANG);
 
+        if (pid > 0) {
+            trace_reap(pid, 0);
+        }
+
         // In case we can't get process status
 
         if (pid == 0) {
@@ -86,6 +123,121 @@ void usage(char * name) {
     exit(EXIT_FAILURE);
 }
 
+// Maps output file and the shared counters, must be done before fork
+
+void append_open(char * name) {
+
+    pthread_mutexattr_t attr;
+    struct stat st;
+
+    if ((region_fd = TEMP_FAILURE_RETRY(open(name, O_CREAT | O_RDWR, 0666))) < 0) {
+        ERR("open");
+    }
+
+    if (fstat(region_fd, &st) < 0) {
+        ERR("fstat");
+    }
+
+    // Address space for the whole window, file behind it grows on demand
+
+    region_data = mmap(NULL, APPEND_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, region_fd, 0);
+    region = mmap(NULL, sizeof(struct append_region), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (region_data == MAP_FAILED || region == MAP_FAILED) {
+        ERR("mmap");
+    }
+
+    // Appending, like O_APPEND in the signal mode
+
+    atomic_store(&region->tail, st.st_size);
+    atomic_store(&region->size, st.st_size);
+
+    if (pthread_mutexattr_init(&attr) || pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED)
+        || pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) || pthread_mutex_init(&region->grow, &attr)) {
+        ERR("pthread_mutex_init");
+    }
+
+    pthread_mutexattr_destroy(&attr);
+}
+
+// Makes file cover [0, end), whoever gets the mutex first grows it for all
+
+void append_grow(uint64_t end) {
+
+    uint64_t size;
+    int err;
+
+    if (end > APPEND_WINDOW) {
+        fprintf(stderr, "append window full\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // EOWNERDEAD: previous owner died holding it. Size is published only
+    // after its ftruncate succeeded, so the state is consistent as it is
+    // and growing once more is harmless
+
+    if (EOWNERDEAD == (err = pthread_mutex_lock(&region->grow))) {
+        if ((err = pthread_mutex_consistent(&region->grow))) {
+            errno = err;
+            ERR("pthread_mutex_consistent");
+        }
+    } else if (err) {
+        errno = err;
+        ERR("pthread_mutex_lock");
+    }
+
+    if ((size = atomic_load(&region->size)) < end) {
+
+        size = (end + APPEND_CHUNK - 1) / APPEND_CHUNK * APPEND_CHUNK;
+
+        if (TEMP_FAILURE_RETRY(ftruncate(region_fd, size)) < 0) {
+            ERR("ftruncate");
+        }
+
+        atomic_store(&region->size, size);
+    }
+
+    pthread_mutex_unlock(&region->grow);
+}
+
+void append_record(unsigned int * seed) {
+
+    uint64_t at = atomic_fetch_add_explicit(&region->tail, RECORD_SIZE, memory_order_relaxed);
+
+    if (at + RECORD_SIZE > atomic_load_explicit(&region->size, memory_order_acquire)) {
+        append_grow(at + RECORD_SIZE);
+    }
+
+    for (int i = 0; i < RECORD_SIZE; i++) {
+        region_data[at + i] = rand_r(seed) % ('z' - 'a' + 1) + 'a';
+    }
+}
+
+// Parent's part: children are done, file is cut down to the records
+
+void append_finish(void) {
+
+    uint64_t tail;
+    pid_t pid;
+    int status;
+
+    while ((pid = TEMP_FAILURE_RETRY(wait(&status))) > 0) {
+        trace_reap(pid, status);
+    }
+
+    tail = atomic_load(&region->tail);
+
+    if (TEMP_FAILURE_RETRY(ftruncate(region_fd, tail)) < 0) {
+        ERR("ftruncate");
+    }
+
+    fprintf(stderr, "[append] %llu bytes in file\n", (unsigned long long) tail);
+
+    if (munmap(region_data, APPEND_WINDOW) || TEMP_FAILURE_RETRY(close(region_fd))) {
+        ERR("close");
+    }
+}
+
 // Function assigning tasks to processes
 
 void child_work(int number) {
@@ -97,31 +249,49 @@ void child_work(int number) {
     // Generating pseudorandom number in [5, 10] range
 
     int t = rand() % (number);
-    struct timespec time = {0, t * 100 * 10000};
+    struct pacer pc;
+
+    pacer_init(&pc, t * 100LL * 10000);
 
     printf("Ni: %d, C: %d\n", number, t);
+
+    unsigned int seed = time(NULL) * getpid();
   
   // Function sending p SIGUSR1 signals
 
     for (int i = 0; i < t; i++) {
 
-        // Nanosleep handles delays
+        // Pacing engine handles delays
+
+        pacer_wait(&pc);
 
-        nanosleep(&time, NULL);
+        // Writing the record in shared append mode, otherwise sending SIGUSR1
+        // to parent and checking if everything went fine
 
-        // Sending SIGUSR1 to parent and checking if everything went fine
+        if (region) {
+            append_record(&seed);
+        } else {
 
-        if (kill(getppid(), SIGUSR1)) {
-            ERR("kill");
+            trace_kill(getppid(), SIGUSR1);
+
+            if (kill(getppid(), SIGUSR1)) {
+                ERR("kill");
+            }
         }
     }
+
+    if (pc.verbose) {
+        pacer_report(&pc);
+    }
 }
 
 // Creating given amount of children
 
 void create_children(char ** argv, int argc) {
+    pid_t pid;
+
     for (int i = 2; i < argc; i++) {
-        switch(fork()) {
+        switch(pid = fork()) {
             case 0:
                 child_work(atoi(argv[i]));
                 // fprintf(stdout, "[%d] terminating\n", getpid());
@@ -131,6 +301,8 @@ void create_children(char ** argv, int argc) {
                 perror("fork");
                 exit(EXIT_FAILURE);
         }
+
+        trace_fork(pid);
     }
 }
 
@@ -139,6 +311,7 @@ void parent_work(char * name) {
     // Opening and creating file with needed arguments
 
     int out;
+    long long block = 0;
 
     out = TEMP_FAILURE_RETRY(open(name, O_APPEND | O_CREAT | O_WRONLY, 0666));
 
@@ -158,7 +331,8 @@ void parent_work(char * name) {
                 buf[i] = rand() % ('z' - 'a' + 1) + 'a';
             }
 
-            TEMP_FAILURE_RETRY(write(out, buf, 100));
+            trace_io_begin(block, 100);
+            trace_io_end(block++, TEMP_FAILURE_RETRY(write(out, buf, 100)));
             last_signal = 0;
 
         }
@@ -167,6 +341,9 @@ void parent_work(char * name) {
 
         while (last_signal != SIGUSR1) {
             pid_t p = waitpid(0, NULL, WNOHANG);
+            if (p > 0) {
+                trace_reap(p, 0);
+            }
             if (p < 0 && errno == ECHILD) {
                 return;
             }
@@ -193,10 +370,28 @@ int main(int argc, char ** argv) {
     // setHandler(SIG_IGN, SIGUSR2);
     signal(SIGCHLD, sigchld_handler);
 
+    // Binary event trace, only with TRACE set (see trace.h)
+
+    trace_init();
+
+    // Children append records themselves in shared mode (APPEND=mmap)
+
+    if (getenv("APPEND") && !strcmp(getenv("APPEND"), "mmap")) {
+        append_open(name);
+        create_children(argv, argc);
+        append_finish();
+        return EXIT_SUCCESS;
+    }
+
     create_children(argv, argc);
     parent_work(name);
 
-    while(wait(NULL) > 0);
+    pid_t pid;
+    int status;
+
+    while((pid = wait(&status)) > 0) {
+        trace_reap(pid, status);
+    }
 
     return EXIT_SUCCESS;
 
@@ -9,6 +9,8 @@
 #include <string.h>
 #include <time.h>
 
+#include "../trace.h"
+
 #define ERR(source) (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
                     perror(source), kill(0, SIGKILL), \
                     exit(EXIT_FAILURE))
@@ -56,6 +58,8 @@ void create_children(int n) {
             child_work(n);
             exit(EXIT_SUCCESS);
         }
+
+        trace_fork(s);
     }
 }
 
@@ -79,6 +83,9 @@ int main(int argc, char ** argv) {
         usage(argv[0]);
     }
 
+    // Binary event trace, only with TRACE set (see trace.h)
+
+    trace_init();
     create_children(n);
 
     // Parent process controls child processes
@@ -94,6 +101,7 @@ int main(int argc, char ** argv) {
             pid = waitpid(0, NULL, WNOHANG);
 
             if (pid > 0) {
+                trace_reap(pid, 0);
                 n--;
             }
 
@@ -9,6 +9,8 @@
 #include <string.h>
 #include <time.h>
 
+#include "../trace.h"
+
 #define ERR(source) (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
                     perror(source), kill(0, SIGKILL), \
                     exit(EXIT_FAILURE))
@@ -42,6 +44,7 @@ void setHandler(void (*f)(int), int sigNo) {
 // Function handling given signal
 
 void sig_handler(int sig) {
+    trace_signal(sig);
     lastSignal = sig;
     counter++;
 }
@@ -59,6 +62,10 @@ void sigchld_handler(int sig) {
 
         pid = waitpid(0, NULL, WNOHANG);
 
+        if (pid > 0) {
+            trace_reap(pid, 0);
+        }
+
         // In case we can't get process status
 
         if (pid == 0) {
@@ -106,6 +113,8 @@ void child_work() {
 
         // Sending SIGUSR1 to parent and checking if everything went fine
 
+        trace_kill(getppid(), SIGUSR1);
+
         if (kill(getppid(), SIGUSR1)) {
             ERR("kill");
         }
@@ -114,8 +123,10 @@ void child_work() {
 }
 
 void create_children(int n) {
+    pid_t pid;
+
     while (n-- > 0) {
-        switch(fork()) {
+        switch(pid = fork()) {
             case 0:
                 child_work();
                 fprintf(stdout, "[%d] terminating\n", getpid());
@@ -125,6 +136,8 @@ void create_children(int n) {
                 perror("fork");
                 exit(EXIT_FAILURE);
         }
+
+        trace_fork(pid);
     }
 }
 
@@ -143,6 +156,7 @@ void parent_work() {
 
             if (pCounter == 100) {
 
+                trace_kill(0, SIGUSR2);
                 kill(0, SIGUSR2);
                 return;
 
@@ -167,10 +181,19 @@ int main(int argc, char ** argv) {
     setHandler(SIG_IGN, SIGUSR2);
     setHandler(sigchld_handler, SIGCHLD);
 
+    // Binary event trace, only with TRACE set (see trace.h)
+
+    trace_init();
+
     create_children(m);
     parent_work();
 
-    while(wait(NULL) > 0);
+    pid_t pid;
+    int status;
+
+    while((pid = wait(&status)) > 0) {
+        trace_reap(pid, status);
+    }
 
     return EXIT_SUCCESS;
 
@@ -0,0 +1,239 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+// Chunk size tuner for the block loops of Task 16 (--auto). Blocks of s
+// bytes are moved in chunks and the tuner picks the chunk size by hill
+// climbing over powers of two from AT_MIN_CHUNK to min(s, AT_MAX_CHUNK).
+// Every size is measured for a window (at least AT_WINDOW_NS of I/O and
+// AT_WINDOW_CHUNKS chunks), the climb goes on to the neighbour while it is
+// faster by AT_GAIN and holds the best size after that. While holding,
+// throughput is watched: off the held rate by AT_DRIFT for two windows in a
+// row starts a new climb. Blocks and their reports stay as with a fixed s,
+// only the calls inside a block change.
+//
+// When AUTOTUNE names a file, the final choice is appended there together
+// with filesystem type of the output, and later runs on the same filesystem
+// type start climbing from it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/vfs.h>
+
+#define AT_MIN_CHUNK (64 * 1024)
+#define AT_MAX_CHUNK (64 * 1024 * 1024)
+#define AT_SIZES 11
+#define AT_START 4
+#define AT_WINDOW_NS 100000000LL
+#define AT_WINDOW_CHUNKS 4
+#define AT_GAIN 0.05
+#define AT_DRIFT 0.25
+
+#define AT_CLIMB 0
+#define AT_HOLD 1
+
+struct autotune {
+    int on;
+    int sizes;
+    int cur;
+    int best;
+    int dir;
+    int state;
+    int drift;
+    unsigned long fs_type;
+
+    // Rate (MB/s) and mean chunk latency of last window of every size,
+    // rate 0 means not measured in this climb
+
+    double rate[AT_SIZES];
+    double latency_ns[AT_SIZES];
+    double held;
+
+    // Current window and totals
+
+    long long win_bytes, win_ns, win_chunks;
+    long long total_bytes, total_ns, max_ns, climbs;
+};
+
+static inline long long at_now(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline size_t at_size(int i) {
+    return (size_t) AT_MIN_CHUNK << i;
+}
+
+static inline size_t at_chunk(struct autotune * at) {
+    return at_size(at->cur);
+}
+
+// Starting point from AUTOTUNE log: last entry of the same filesystem type
+
+static inline void at_load(struct autotune * at) {
+
+    char * path = getenv("AUTOTUNE");
+    char line[256];
+    unsigned long fs;
+    size_t chunk;
+    FILE * f;
+
+    if (!path || !(f = fopen(path, "r"))) {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        if (2 == sscanf(line, "fs=%lx chunk=%zu", &fs, &chunk) && fs == at->fs_type) {
+            for (int i = 0; i < at->sizes; i++) {
+                if (at_size(i) == chunk) {
+                    at->cur = i;
+                }
+            }
+        }
+    }
+
+    fclose(f);
+}
+
+static inline void at_init(struct autotune * at, size_t s, int out) {
+
+    struct statfs sf;
+
+    memset(at, 0, sizeof(struct autotune));
+    at->on = 1;
+    at->dir = 1;
+
+    while (at->sizes < AT_SIZES && at_size(at->sizes) <= s && at_size(at->sizes) <= AT_MAX_CHUNK) {
+        at->sizes++;
+    }
+
+    if (!at->sizes) {
+        at->sizes = 1;
+    }
+
+    at->cur = at->best = AT_START < at->sizes ? AT_START : at->sizes - 1;
+
+    if (!fstatfs(out, &sf)) {
+        at->fs_type = sf.f_type;
+    }
+
+    at_load(at);
+    at->best = at->cur;
+}
+
+static inline void at_hold(struct autotune * at) {
+
+    at->cur = at->best;
+    at->state = AT_HOLD;
+    at->held = at->rate[at->best];
+    at->drift = 0;
+
+    fprintf(stderr, "[auto] chunk %zu KB: %.1f MB/s, chunk latency %.3f ms\n", at_chunk(at) / 1024,
+            at->rate[at->best], at->latency_ns[at->best] / 1e6);
+}
+
+// Decision at the end of a window measured at the current size
+
+static inline void at_window(struct autotune * at, double rate, double latency_ns) {
+
+    if (AT_HOLD == at->state) {
+
+        double off = rate > at->held ? rate - at->held : at->held - rate;
+
+        if (off <= AT_DRIFT * at->held) {
+            at->drift = 0;
+            at->held = 0.8 * at->held + 0.2 * rate;
+            return;
+        }
+
+        if (++at->drift < 2) {
+            return;
+        }
+
+        // Throughput drifted, climbing again from here
+
+        fprintf(stderr, "[auto] drift %.1f -> %.1f MB/s, probing again\n", at->held, rate);
+        memset(at->rate, 0, sizeof(at->rate));
+        at->state = AT_CLIMB;
+        at->dir = 1;
+        at->climbs++;
+    }
+
+    at->rate[at->cur] = rate;
+    at->latency_ns[at->cur] = latency_ns;
+
+    if (at->cur != at->best && rate > at->rate[at->best] * (1 + AT_GAIN)) {
+        at->best = at->cur;
+    }
+
+    // Next unmeasured neighbour in climb direction, turning down once
+
+    while (1) {
+
+        int next = at->best + at->dir;
+
+        if (next >= 0 && next < at->sizes && !at->rate[next]) {
+            at->cur = next;
+            return;
+        }
+
+        if (at->dir < 0) {
+            break;
+        }
+
+        at->dir = -1;
+    }
+
+    at_hold(at);
+}
+
+// Accounts one chunk that moved bytes in ns
+
+static inline void at_record(struct autotune * at, long long bytes, long long ns) {
+
+    at->win_bytes += bytes;
+    at->win_ns += ns;
+    at->win_chunks++;
+    at->total_bytes += bytes;
+    at->total_ns += ns;
+
+    if (ns > at->max_ns) {
+        at->max_ns = ns;
+    }
+
+    if (at->win_ns < AT_WINDOW_NS || at->win_chunks < AT_WINDOW_CHUNKS) {
+        return;
+    }
+
+    at_window(at, at->win_bytes / (at->win_ns / 1e9) / (1024 * 1024), (double) at->win_ns / at->win_chunks);
+    at->win_bytes = at->win_ns = at->win_chunks = 0;
+}
+
+// Final choice on stderr and in AUTOTUNE log for reuse
+
+static inline void at_finish(struct autotune * at) {
+
+    char * path = getenv("AUTOTUNE");
+    double rate = at->total_ns ? at->total_bytes / (at->total_ns / 1e9) / (1024 * 1024) : 0;
+    int best = at->best;
+    FILE * f;
+
+    fprintf(stderr, "[auto] final chunk %zu KB (%s), %.1f MB/s overall, max chunk latency %.3f ms, %lld re-probes\n",
+            at_size(best) / 1024, AT_HOLD == at->state ? "converged" : "still probing",
+            rate, at->max_ns / 1e6, at->climbs);
+
+    if (!path || !(f = fopen(path, "a"))) {
+        return;
+    }
+
+    fprintf(f, "fs=%lx chunk=%zu rate=%.1f latency_ms=%.3f\n", at->fs_type,
+            at_size(best), at->rate[best] ? at->rate[best] : rate,
+            at->latency_ns[best] / 1e6);
+    fclose(f);
+}
+
+#endif
@@ -0,0 +1,662 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <linux/perf_event.h>
+
+#define ERR(source) (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
+                    perror(source), exit(EXIT_FAILURE))
+
+// Benchmark driver for all the lab programs. Every scenario is started in
+// its own process group (the labs love kill(0, ...)) with output thrown
+// away, cost of the whole tree comes from wait4: children reaped inside the
+// tree are accounted to its root. Programs that never end on their own are
+// stopped after their time limit and reported with status "limit".
+//
+// Signals delivered are counted with signal:signal_deliver tracepoint
+// (perf_event_open, inherited by the whole tree), ru_nsignals is always 0
+// on Linux. Without tracefs access the column is -1.
+//
+// Programs may report their own metrics: BENCH_METRICS names a scratch file
+// where they append "key value" lines, those end up in the last column as
+// key=value pairs separated by ';' (see perfctr.h).
+
+#define MAX_ARGS 8
+#define MAX_METRICS 8192
+#define MAX_SCENARIOS 128
+#define GRID_AXES 5
+#define GRID_VALUES 4
+#define POLL_NS 1000000LL
+#define DEFAULT_TOLERANCE 10.0
+
+// Absolute differences below these are noise, not regressions
+
+#define NOISE_WALL_S 0.05
+#define NOISE_CPU_S 0.02
+#define NOISE_CS 200
+#define NOISE_RSS_KB 1024
+
+// @OUT in arguments is replaced by a scratch file removed after the run
+
+struct scenario {
+    const char * name;
+    const char * env;
+    double limit_s;
+    const char * argv[MAX_ARGS];
+};
+
+struct scenario fixed[] = {
+    {"prog13a_vtime_1000", "VTIME=1", 0, {"prog13a", "1000"}},
+    {"prog13a_4", NULL, 0, {"prog13a", "4"}},
+    {"prog14_vproc_1000", "VPROC=1", 0, {"prog14", "1000", "1", "1", "1"}},
+    {"prog15_plain_10", NULL, 2, {"prog15", "10", "100"}},
+    {"prog15_rt_10_k4", NULL, 2, {"prog15", "10", "100", "rt", "4"}},
+    {"prog15_signalfd_10", NULL, 2, {"prog15", "10", "100", "signalfd"}},
+    {"prog15_eventfd_0", NULL, 2, {"prog15", "0", "100", "eventfd"}},
+    {"prog15_shm_0", NULL, 2, {"prog15", "0", "100", "shm"}},
+    {"prog16a_10_10_1", NULL, 0, {"prog16a", "10", "10", "1", "@OUT"}},
+    {"prog16b_10_10_1", NULL, 0, {"prog16b", "10", "10", "1", "@OUT"}},
+    {"prog16b_1_100_8", NULL, 0, {"prog16b", "1", "100", "8", "@OUT"}},
+    {"prog16b_perf_1_100_8", NULL, 0, {"prog16b_perf", "1", "100", "8", "@OUT"}},
+    {"prog16b_999_64_1", NULL, 0, {"prog16b", "999", "64", "1", "@OUT"}},
+    {"prog16b_vec16_999_64_1", "IOVEC=16", 0, {"prog16b", "999", "64", "1", "@OUT"}},
+    {"ipcbench_10000", NULL, 0, {"ipcbench", "10000"}},
+    {"teams1_10_20", NULL, 0, {"Teams_Lab/prog1", "x", "10", "20"}},
+    {"teams2_10_20", NULL, 2, {"Teams_Lab/prog2", "x", "10", "20"}},
+    {"teams2_ring_100000", "RING=100000", 0, {"Teams_Lab/prog2", "x", "10", "20"}},
+    {"teams3_10_20", NULL, 0, {"Teams_Lab/prog3", "@OUT", "10", "20"}},
+    {"teams3_mmap_10_20", "APPEND=mmap", 0, {"Teams_Lab/prog3", "@OUT", "10", "20"}},
+    {"website1_3", NULL, 0, {"Website_Labs/prog1", "3"}},
+    {"website2_3", NULL, 0, {"Website_Labs/prog2", "3"}},
+    {"website3_3", NULL, 2, {"Website_Labs/prog3", "3"}},
+    {"website4_3", NULL, 0, {"Website_Labs/prog4", "3"}},
+    {"website5_3", NULL, 0, {"Website_Labs/prog5", "3"}},
+    {"labs2019_10_signal", NULL, 0, {"Labs_2019/main", "10", "0"}},
+    {"labs2019_10_counter", NULL, 0, {"Labs_2019/main", "10", "1"}},
+    {"labs2019_vproc_1000", "VPROC=1", 0, {"Labs_2019/main", "1000", "1"}},
+};
+
+// Parameter grid, expanded into one scenario per combination of axis
+// values. Axis i replaces "@i" in arguments (an empty value drops the
+// argument) and adds "_<label><value>" to the name, nothing when empty
+
+struct grid_axis {
+    const char * label;
+    const char * values[GRID_VALUES];
+};
+
+struct grid {
+    const char * prefix;
+    const char * env;
+    double limit_s;
+    const char * argv[MAX_ARGS];
+    struct grid_axis axes[GRID_AXES];
+};
+
+// Task 14 over (n, k, p, l, g): real runs take l * 10 seconds each, so the
+// wide sweep runs on the virtual clock
+
+struct grid grids[] = {
+    {"prog14", NULL, 0, {"prog14", "@0", "@1", "@2", "@3", "@4"},
+     {{"", {"5", "20"}}, {"", {"1"}}, {"", {"1"}}, {"", {"1"}}, {"g", {"", "4"}}}},
+    {"prog14_vtime", "VTIME=1", 0, {"prog14", "@0", "@1", "@2", "10", "@3"},
+     {{"", {"100", "1000"}}, {"k", {"1", "2"}}, {"p", {"1", "3"}}, {"g", {"", "10"}}}},
+};
+
+#define FIXED_COUNT ((int) (sizeof(fixed) / sizeof(fixed[0])))
+#define GRID_COUNT ((int) (sizeof(grids) / sizeof(grids[0])))
+
+// Fixed scenarios followed by expanded grids, names are copied
+
+struct scenario scenarios[MAX_SCENARIOS];
+char scenario_names[MAX_SCENARIOS][64];
+int scenario_count = 0;
+
+struct result {
+    char name[64];
+    char status[16];
+    double wall_s;
+    double user_s;
+    double sys_s;
+    long nvcsw;
+    long nivcsw;
+    long long signals;
+    long maxrss_kb;
+    char metrics[MAX_METRICS];
+};
+
+long long now_ns(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+double tv_s(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Returns tracepoint id of signal:signal_deliver, -1 without tracefs
+
+long long signal_deliver_id(void) {
+
+    const char * dirs[] = {getenv("TRACEFS"), "/sys/kernel/tracing", "/sys/kernel/debug/tracing"};
+    char path[512];
+    long long id = -1;
+
+    for (int i = 0; i < 3 && id < 0; i++) {
+
+        if (!dirs[i]) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/events/signal/signal_deliver/id", dirs[i]);
+
+        FILE * f = fopen(path, "r");
+
+        if (f) {
+            if (fscanf(f, "%lld", &id) != 1) {
+                id = -1;
+            }
+            fclose(f);
+        }
+    }
+
+    return id;
+}
+
+// Counter of signals delivered to pid and everything it forks from now on
+
+int signal_counter(pid_t pid, long long id) {
+
+    struct perf_event_attr attr;
+
+    if (id < 0) {
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.size = sizeof(attr);
+    attr.config = id;
+    attr.inherit = 1;
+
+    return syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+void add_scenario(struct scenario * sc) {
+
+    if (MAX_SCENARIOS == scenario_count) {
+        fprintf(stderr, "more than %d scenarios\n", MAX_SCENARIOS);
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(scenario_names[scenario_count], sizeof(scenario_names[0]), "%s", sc->name);
+    scenarios[scenario_count] = *sc;
+    scenarios[scenario_count].name = scenario_names[scenario_count];
+    scenario_count++;
+}
+
+// Adds one scenario per combination, last axis changes fastest
+
+void expand_grid(struct grid * g) {
+
+    int idx[GRID_AXES] = {0}, a;
+
+    do {
+
+        char name[64];
+        struct scenario sc = {name, g->env, g->limit_s, {NULL}};
+        int argc = 0;
+
+        snprintf(name, sizeof(name), "%s", g->prefix);
+
+        for (a = 0; a < GRID_AXES && g->axes[a].values[0]; a++) {
+
+            const char * v = g->axes[a].values[idx[a]];
+            size_t len = strlen(name);
+
+            if (*v) {
+                snprintf(name + len, sizeof(name) - len, "_%s%s", g->axes[a].label, v);
+            }
+        }
+
+        for (int i = 0; i < MAX_ARGS && g->argv[i]; i++) {
+
+            const char * arg = g->argv[i];
+
+            if ('@' == arg[0] && arg[1] >= '0' && arg[1] < '0' + GRID_AXES && !arg[2]) {
+
+                arg = g->axes[arg[1] - '0'].values[idx[arg[1] - '0']];
+
+                if (!*arg) {
+                    continue;
+                }
+            }
+
+            sc.argv[argc++] = arg;
+        }
+
+        add_scenario(&sc);
+
+        // Next combination, mixed-radix increment
+
+        for (a = GRID_AXES - 1; a >= 0; a--) {
+
+            if (!g->axes[a].values[0]) {
+                continue;
+            }
+
+            if (++idx[a] < GRID_VALUES && g->axes[a].values[idx[a]]) {
+                break;
+            }
+
+            idx[a] = 0;
+        }
+    } while (a >= 0);
+}
+
+// Child side of a run: new process group, output to /dev/null, waits for
+// the counter to be attached before exec. Never returns
+
+__attribute__((noreturn)) void exec_scenario(struct scenario * sc, const char * bin_dir, const char * out, const char * metrics, int gate) {
+
+    char path[512], c;
+    char * argv[MAX_ARGS + 1];
+    int fd;
+
+    if (setpgid(0, 0) < 0) {
+        ERR("setpgid");
+    }
+
+    if ((fd = open("/dev/null", O_WRONLY)) < 0) {
+        ERR("open");
+    }
+
+    if (dup2(fd, STDOUT_FILENO) < 0 || dup2(fd, STDERR_FILENO) < 0) {
+        ERR("dup2");
+    }
+
+    close(fd);
+
+    if ((sc->env && putenv((char *) sc->env)) || setenv("BENCH_METRICS", metrics, 1)) {
+        ERR("putenv");
+    }
+
+    for (int i = 0; i < MAX_ARGS; i++) {
+        argv[i] = sc->argv[i] && !strcmp(sc->argv[i], "@OUT") ? (char *) out : (char *) sc->argv[i];
+    }
+
+    argv[MAX_ARGS] = NULL;
+    snprintf(path, sizeof(path), "%s/%s", bin_dir, sc->argv[0]);
+
+    if (read(gate, &c, 1) < 0) {
+        ERR("read");
+    }
+
+    close(gate);
+    execv(path, argv);
+    _exit(127);
+}
+
+void run_scenario(struct scenario * sc, const char * bin_dir, long long id, struct result * r) {
+
+    char out[512], metrics[512], line[256];
+    const char * tmp = getenv("TMPDIR");
+    int gate[2], status, counter;
+    struct rusage ru;
+    pid_t pid;
+
+    snprintf(out, sizeof(out), "%s/lab_bench_%d.out", tmp ? tmp : "/tmp", getpid());
+    snprintf(metrics, sizeof(metrics), "%s/lab_bench_%d.metrics", tmp ? tmp : "/tmp", getpid());
+    unlink(metrics);
+    memset(r, 0, sizeof(struct result));
+    snprintf(r->name, sizeof(r->name), "%s", sc->name);
+
+    if (pipe(gate) < 0) {
+        ERR("pipe");
+    }
+
+    fflush(stdout);
+
+    long long start = now_ns();
+
+    switch (pid = fork()) {
+        case 0:
+            close(gate[1]);
+            exec_scenario(sc, bin_dir, out, metrics, gate[0]);
+        case -1:
+            ERR("fork");
+    }
+
+    close(gate[0]);
+
+    // setpgid on both sides, killpg below must never hit us
+
+    if (setpgid(pid, pid) < 0 && errno != EACCES) {
+        ERR("setpgid");
+    }
+
+    counter = signal_counter(pid, id);
+
+    if (write(gate[1], "x", 1) < 0) {
+        ERR("write");
+    }
+
+    close(gate[1]);
+
+    // Polling so the time limit can be enforced
+
+    long long limit = sc->limit_s * 1e9;
+    struct timespec poll = {0, POLL_NS};
+    pid_t w;
+
+    snprintf(r->status, sizeof(r->status), "ok");
+
+    while ((w = wait4(pid, &status, WNOHANG, &ru)) == 0) {
+        if (limit && now_ns() - start >= limit) {
+            killpg(pid, SIGKILL);
+            snprintf(r->status, sizeof(r->status), "limit");
+        }
+        nanosleep(&poll, NULL);
+    }
+
+    if (w < 0) {
+        ERR("wait4");
+    }
+
+    r->wall_s = (now_ns() - start) / 1e9;
+
+    // Stragglers the root didn't wait for
+
+    killpg(pid, SIGKILL);
+
+    if (strcmp(r->status, "limit") && (!WIFEXITED(status) || WEXITSTATUS(status))) {
+        snprintf(r->status, sizeof(r->status), "fail(%d)", WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status));
+    }
+
+    r->user_s = tv_s(ru.ru_utime);
+    r->sys_s = tv_s(ru.ru_stime);
+    r->nvcsw = ru.ru_nvcsw;
+    r->nivcsw = ru.ru_nivcsw;
+    r->maxrss_kb = ru.ru_maxrss;
+    r->signals = -1;
+
+    if (counter >= 0) {
+        if (read(counter, &r->signals, sizeof(r->signals)) != sizeof(r->signals)) {
+            r->signals = -1;
+        }
+        close(counter);
+    }
+
+    unlink(out);
+
+    // Program's own metrics, "key value" per line
+
+    FILE * f = fopen(metrics, "r");
+    char key[128], value[128];
+
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+
+            size_t len = strlen(r->metrics);
+
+            if (sscanf(line, "%127s %127s", key, value) == 2) {
+                snprintf(r->metrics + len, sizeof(r->metrics) - len, "%s%s=%s", len ? ";" : "", key, value);
+            }
+        }
+        fclose(f);
+        unlink(metrics);
+    }
+}
+
+// Folds c-th repetition r into running mean m
+
+void mean_add(struct result * m, struct result * r, int c) {
+    m->wall_s += (r->wall_s - m->wall_s) / c;
+    m->user_s += (r->user_s - m->user_s) / c;
+    m->sys_s += (r->sys_s - m->sys_s) / c;
+    m->nvcsw += (long) ((double) (r->nvcsw - m->nvcsw) / c);
+    m->nivcsw += (long) ((double) (r->nivcsw - m->nivcsw) / c);
+    m->signals += (long long) ((double) (r->signals - m->signals) / c);
+    m->maxrss_kb += (long) ((double) (r->maxrss_kb - m->maxrss_kb) / c);
+}
+
+void print_header(FILE * f) {
+    fprintf(f, "name,rep,status,wall_s,user_s,sys_s,nvcsw,nivcsw,signals,maxrss_kb,metrics\n");
+}
+
+void print_result(FILE * f, struct result * r, int rep) {
+    fprintf(f, "%s,%d,%s,%.3f,%.3f,%.3f,%ld,%ld,%lld,%ld,%s\n", r->name, rep, r->status, r->wall_s,
+            r->user_s, r->sys_s, r->nvcsw, r->nivcsw, r->signals, r->maxrss_kb, r->metrics);
+}
+
+// Reads CSV written by print_result, repetitions of a scenario are averaged
+
+int load_csv(const char * path, struct result * res, int max) {
+
+    char line[MAX_METRICS + 256];
+    int n = 0, counts[MAX_SCENARIOS] = {0};
+    FILE * f = fopen(path, "r");
+
+    if (!f) {
+        ERR("fopen");
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+
+        struct result r;
+        int rep, i;
+
+        if (sscanf(line, "%63[^,],%d,%15[^,],%lf,%lf,%lf,%ld,%ld,%lld,%ld", r.name, &rep, r.status, &r.wall_s,
+                   &r.user_s, &r.sys_s, &r.nvcsw, &r.nivcsw, &r.signals, &r.maxrss_kb) != 10) {
+            continue;
+        }
+
+        for (i = 0; i < n && strcmp(res[i].name, r.name); i++);
+
+        if (i == n) {
+            if (n == max) {
+                continue;
+            }
+            memset(&res[n++], 0, sizeof(struct result));
+            snprintf(res[i].name, sizeof(res[i].name), "%s", r.name);
+            snprintf(res[i].status, sizeof(res[i].status), "%s", r.status);
+        }
+
+        mean_add(&res[i], &r, ++counts[i]);
+    }
+
+    fclose(f);
+    return n;
+}
+
+// Metric got worse by more than tol percent and by more than noise
+
+int worse(double base, double cur, double tol, double noise) {
+    return cur - base > noise && cur > base * (1 + tol / 100);
+}
+
+// Compares current results with baseline, returns number of regressions
+
+int compare(struct result * base, int nb, struct result * cur, int nc, double tol) {
+
+    int regressions = 0;
+
+    printf("%-28s %-8s %9s %9s %9s %9s %11s %11s %10s %10s\n", "scenario", "verdict", "wall", "base",
+           "cpu", "base", "cs", "base", "rss KB", "base");
+
+    for (int i = 0; i < nc; i++) {
+
+        struct result * c = &cur[i], * b = NULL;
+
+        for (int j = 0; j < nb; j++) {
+            if (!strcmp(base[j].name, c->name)) {
+                b = &base[j];
+            }
+        }
+
+        if (!b) {
+            printf("%-28s %-8s\n", c->name, "new");
+            continue;
+        }
+
+        double cpu = c->user_s + c->sys_s, bcpu = b->user_s + b->sys_s;
+        long cs = c->nvcsw + c->nivcsw, bcs = b->nvcsw + b->nivcsw;
+
+        // Wall time of scenarios stopped by the limit says nothing
+
+        int bad = (strcmp(c->status, "limit") && worse(b->wall_s, c->wall_s, tol, NOISE_WALL_S))
+                  || worse(bcpu, cpu, tol, NOISE_CPU_S) || worse(bcs, cs, tol, NOISE_CS)
+                  || worse(b->maxrss_kb, c->maxrss_kb, tol, NOISE_RSS_KB)
+                  || (!strncmp(c->status, "fail", 4) && strncmp(b->status, "fail", 4));
+
+        regressions += bad;
+        printf("%-28s %-8s %9.3f %9.3f %9.3f %9.3f %11ld %11ld %10ld %10ld\n", c->name, bad ? "REGRESS" : "ok",
+               c->wall_s, b->wall_s, cpu, bcpu, cs, bcs, c->maxrss_kb, b->maxrss_kb);
+    }
+
+    printf("%d regression(s), tolerance %.1f%%\n", regressions, tol);
+    return regressions;
+}
+
+void usage(char * name) {
+
+    fprintf(stderr, "USAGE: %s [-d bin_dir] [-r reps] [-o out.csv] [-c baseline.csv [-i current.csv]] [-t tol] [filter]\n", name);
+    fprintf(stderr, "-d - directory with built programs (default bin)\n");
+    fprintf(stderr, "-r - repetitions of every scenario (default 1)\n");
+    fprintf(stderr, "-o - CSV output (default stdout)\n");
+    fprintf(stderr, "-c - compare with baseline CSV, exit status 1 on regression\n");
+    fprintf(stderr, "-i - compare this CSV instead of running scenarios\n");
+    fprintf(stderr, "-t - regression tolerance in percent (default %.0f)\n", DEFAULT_TOLERANCE);
+    fprintf(stderr, "filter - run only scenarios whose name contains it, -l lists them\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char ** argv) {
+
+    const char * bin_dir = "bin", * out_path = NULL, * base_path = NULL, * cur_path = NULL, * filter = NULL;
+    double tol = DEFAULT_TOLERANCE;
+    int reps = 1, opt;
+
+    // Two tables of MAX_SCENARIOS results with metrics are megabytes, off the stack
+
+    static struct result base[MAX_SCENARIOS], cur[MAX_SCENARIOS];
+    int nb = 0, nc = 0;
+    FILE * out = stdout;
+
+    for (int i = 0; i < FIXED_COUNT; i++) {
+        add_scenario(&fixed[i]);
+    }
+
+    for (int i = 0; i < GRID_COUNT; i++) {
+        expand_grid(&grids[i]);
+    }
+
+    while ((opt = getopt(argc, argv, "d:r:o:c:i:t:l")) != -1) {
+        switch (opt) {
+            case 'd':
+                bin_dir = optarg;
+                break;
+            case 'r':
+                if ((reps = atoi(optarg)) <= 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            case 'c':
+                base_path = optarg;
+                break;
+            case 'i':
+                cur_path = optarg;
+                break;
+            case 't':
+                tol = atof(optarg);
+                break;
+            case 'l':
+                for (int i = 0; i < scenario_count; i++) {
+                    printf("%s\n", scenarios[i].name);
+                }
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (optind < argc) {
+        filter = argv[optind++];
+    }
+
+    if (optind < argc || (cur_path && !base_path)) {
+        usage(argv[0]);
+    }
+
+    if (!cur_path) {
+
+        long long id = signal_deliver_id();
+
+        // With comparison the table goes to stdout, CSV only to a file
+
+        if (out_path && !(out = fopen(out_path, "w"))) {
+            ERR("fopen");
+        }
+
+        if (base_path && !out_path) {
+            out = NULL;
+        }
+
+        if (out) {
+            print_header(out);
+        }
+
+        for (int i = 0; i < scenario_count; i++) {
+
+            if (filter && !strstr(scenarios[i].name, filter)) {
+                continue;
+            }
+
+            for (int rep = 0; rep < reps; rep++) {
+
+                struct result r;
+
+                run_scenario(&scenarios[i], bin_dir, id, &r);
+                fprintf(stderr, "%-28s %-8s %.2f s\n", r.name, r.status, r.wall_s);
+
+                if (out) {
+                    print_result(out, &r, rep);
+                    fflush(out);
+                }
+
+                if (0 == rep) {
+                    cur[nc++] = r;
+                } else {
+                    mean_add(&cur[nc - 1], &r, rep + 1);
+                }
+            }
+        }
+
+        if (out && out != stdout) {
+            fclose(out);
+        }
+    } else {
+        nc = load_csv(cur_path, cur, MAX_SCENARIOS);
+    }
+
+    if (base_path) {
+        nb = load_csv(base_path, base, MAX_SCENARIOS);
+        return compare(base, nb, cur, nc, tol) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,241 @@
+#ifndef BUFALLOC_H
+#define BUFALLOC_H
+
+// Block buffer allocator for Task 16, mode from HUGEBUF environment variable:
+//
+//   malloc - plain malloc like without HUGEBUF, only with the report
+//   thp    - anonymous mapping aligned to 2 MB, MADV_HUGEPAGE, prefaulted
+//   huge   - MAP_HUGETLB with 1 GB or 2 MB pages (reserved ones, see
+//            vm.nr_hugepages), thp when there are none
+//
+// Prefaulting (MAP_POPULATE, MADV_POPULATE_WRITE) takes the first-touch
+// faults out of the block loop, huge pages cut their number and TLB misses.
+// Every run allocates its one buffer once, so there is nothing to reuse:
+// the buffer is released at the end. Faults of the allocation and of the
+// loop, and time of first block against the rest are printed on stderr.
+// Without HUGEBUF it is plain malloc / free and blocks aren't timed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#define BUF_2MB (2UL << 20)
+#define BUF_1GB (1UL << 30)
+
+#define BUF_MALLOC 0
+#define BUF_THP 1
+#define BUF_HUGE 2
+
+static const char * buf_kinds[] = {"malloc", "thp", "hugetlb 2MB", "hugetlb 1GB"};
+
+// What the current buffer is, mode is read from the environment once
+
+static size_t buf_size = 0;
+static size_t buf_map_size = 0;
+static int buf_kind = 0;
+static int buf_env_mode = -2;
+
+// Report
+
+static long long buf_alloc_faults = 0, buf_alloc_ns = 0, buf_loop_faults = 0;
+static long long buf_first_ns = -1, buf_rest_ns = 0, buf_rest_count = 0;
+
+static inline long long buf_now(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline long long buf_faults(void) {
+
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt + ru.ru_majflt;
+}
+
+static inline int buf_mode(void) {
+
+    char * env;
+
+    if (buf_env_mode > -2) {
+        return buf_env_mode;
+    }
+
+    if (!(env = getenv("HUGEBUF"))) {
+        buf_env_mode = -1;
+    } else if (!strcmp(env, "huge")) {
+        buf_env_mode = BUF_HUGE;
+    } else {
+        buf_env_mode = strcmp(env, "thp") ? BUF_MALLOC : BUF_THP;
+    }
+
+    return buf_env_mode;
+}
+
+static inline void * buf_map(size_t size, int flags) {
+
+    void * p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// Transparent huge pages need 2 MB alignment, the mapping is trimmed to it
+
+static inline char * buf_thp(size_t size) {
+
+    size_t len = (size + BUF_2MB - 1) & ~(BUF_2MB - 1);
+    char * p = buf_map(len + BUF_2MB, 0);
+    char * aligned;
+
+    if (!p) {
+        return NULL;
+    }
+
+    aligned = (char *) (((uintptr_t) p + BUF_2MB - 1) & ~(BUF_2MB - 1));
+
+    if (aligned > p) {
+        munmap(p, aligned - p);
+    }
+
+    munmap(aligned + len, p + BUF_2MB - aligned);
+    madvise(aligned, len, MADV_HUGEPAGE);
+
+    // Older kernels don't know MADV_POPULATE_WRITE, touching does the same
+
+    if (madvise(aligned, len, MADV_POPULATE_WRITE)) {
+        for (size_t i = 0; i < len; i += 4096) {
+            aligned[i] = 0;
+        }
+    }
+
+    buf_map_size = len;
+    return aligned;
+}
+
+static inline char * buf_get(size_t size) {
+
+    int mode = buf_mode();
+    long long faults, start;
+    char * p = NULL;
+
+    if (mode < 0) {
+        return malloc(size);
+    }
+
+    faults = buf_faults();
+    start = buf_now();
+    buf_map_size = 0;
+
+    // 1 GB pages only when they don't waste more than half of it
+
+    if (BUF_HUGE == mode && size >= BUF_1GB / 2) {
+        buf_map_size = (size + BUF_1GB - 1) & ~(BUF_1GB - 1);
+        p = buf_map(buf_map_size, MAP_HUGETLB | MAP_HUGE_1GB | MAP_POPULATE);
+        buf_kind = 3;
+    }
+
+    if (BUF_HUGE == mode && !p) {
+        buf_map_size = (size + BUF_2MB - 1) & ~(BUF_2MB - 1);
+        p = buf_map(buf_map_size, MAP_HUGETLB | MAP_HUGE_2MB | MAP_POPULATE);
+        buf_kind = 2;
+    }
+
+    if (BUF_MALLOC != mode && !p) {
+        p = buf_thp(size);
+        buf_kind = 1;
+    }
+
+    if (BUF_MALLOC == mode || !p) {
+        p = malloc(size);
+        buf_map_size = 0;
+        buf_kind = 0;
+    }
+
+    buf_alloc_faults += buf_faults() - faults;
+    buf_alloc_ns += buf_now() - start;
+    buf_size = size;
+    return p;
+}
+
+// One buffer at a time is all Task 16 needs
+
+static inline void buf_free(char * p) {
+
+    if (buf_map_size) {
+        munmap(p, buf_map_size);
+        buf_map_size = 0;
+    } else {
+        free(p);
+    }
+}
+
+// Block loop accounting: faults since loop start, first block apart
+
+static inline void buf_loop_begin(void) {
+    buf_loop_faults = buf_faults();
+}
+
+// Start of a block, 0 when blocks aren't timed (no HUGEBUF)
+
+static inline long long buf_block_begin(void) {
+    return buf_mode() < 0 ? 0 : buf_now();
+}
+
+static inline void buf_block(long long start) {
+
+    long long ns;
+
+    if (!start) {
+        return;
+    }
+
+    ns = buf_now() - start;
+
+    if (buf_first_ns < 0) {
+        buf_first_ns = ns;
+    } else {
+        buf_rest_ns += ns;
+        buf_rest_count++;
+    }
+}
+
+static inline void buf_report(void) {
+
+    if (buf_mode() < 0) {
+        return;
+    }
+
+    fprintf(stderr, "[buf] %s %.1f MB: allocation %.3f ms, %lld faults; loop %lld faults\n",
+            buf_kinds[buf_kind], buf_size / 1048576.0, buf_alloc_ns / 1e6, buf_alloc_faults,
+            buf_faults() - buf_loop_faults);
+
+    if (buf_first_ns >= 0) {
+        fprintf(stderr, "[buf] first block %.3f ms, steady %.3f ms mean of %lld\n", buf_first_ns / 1e6,
+                buf_rest_count ? buf_rest_ns / 1e6 / buf_rest_count : 0.0, buf_rest_count);
+    }
+}
+
+#endif
@@ -0,0 +1,16 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sys/types.h>
+
+// LD_PRELOAD shim for make check: in-kernel copy is refused the way some
+// filesystem pairs refuse it, so prog16b falls back to read/write
+
+ssize_t copy_file_range(int in, off_t * off_in, int out, off_t * off_out, size_t len, unsigned int flags) {
+    errno = EXDEV;
+    return -1;
+}
+
+ssize_t sendfile(int out, int in, off_t * offset, size_t count) {
+    errno = EINVAL;
+    return -1;
+}
@@ -0,0 +1,775 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shmring.h"
+
+#define ERR(source) (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
+                    perror(source), kill(0, SIGKILL), \
+                    exit(EXIT_FAILURE))
+
+// IPC micro-benchmark: for every primitive and CPU placement a parent and
+// a forked child measure one-way throughput (parent sends n messages, child
+// counts them) and ping-pong round trip (n exchanges after a warm-up, with
+// percentiles). Direction 0 is parent to child, 1 child to parent.
+//
+// One-way counts are in each primitive's own unit: eventfd and futex sum
+// increments, so one wake-up can take many of them, while pipe, seqpacket
+// and ring hand over batches. Rows say what a message is and how many came
+// per wake-up of the child, which is the cost actually compared.
+
+#define DEFAULT_MESSAGES 100000
+#define WARMUP 1000
+#define SEND_BATCH 32
+#define MSG_SIZE 8
+#define RING_RECORDS 4096
+
+#define PLACE_SAME 0
+#define PLACE_SIBLING 1
+#define PLACE_SOCKET 2
+#define PLACES 3
+
+const char * place_names[PLACES] = {"same", "sibling", "socket"};
+
+// Shared by parent and child of a run, futex words on their own lines
+
+struct shared {
+    _Atomic int ready;
+    long long received;
+    long long wakes;
+    long long end_ns;
+    struct {
+        _Atomic uint32_t seq __attribute__((aligned(64)));
+        _Atomic uint32_t waiting;
+    } fx[2];
+};
+
+struct primitive {
+    const char * name;
+
+    // What one counted message is
+
+    const char * unit;
+
+    // Messages per send call in one-way test
+
+    int batch;
+    void (*open)(void);
+    void (*send)(int dir, int count);
+
+    // Waits for messages, returns how many came (0 is allowed)
+
+    long long (*recv)(int dir);
+
+    // End of one-way stream for primitives that may lose messages
+
+    void (*finish)(int dir);
+    void (*close)(void);
+};
+
+struct shared * sh;
+pid_t peer;
+int fds[2][2];
+struct ring * rings[2];
+uint32_t fx_seen[2];
+long long pipe_rest;
+sigset_t wait_mask;
+
+volatile sig_atomic_t sig_count = 0;
+volatile sig_atomic_t sig_done = 0;
+
+// Original affinity, placements are picked from it
+
+cpu_set_t allowed;
+
+long long now_ns(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void setHandler(void (*f)(int), int sigNo) {
+
+    struct sigaction act;
+
+    memset(&act, 0, sizeof(struct sigaction));
+    act.sa_handler = f;
+
+    if (-1 == sigaction(sigNo, &act, NULL)) {
+        ERR("sigaction");
+    }
+}
+
+void count_handler(int sig) {
+    sig_count++;
+}
+
+void done_handler(int sig) {
+    sig_done = 1;
+}
+
+// Signals: SIGUSR1 per message, SIGUSR2 ends the stream (delivered after
+// pending SIGUSR1 as lower numbers go first)
+
+void signal_send(int dir, int count) {
+    for (int i = 0; i < count; i++) {
+        if (kill(peer, SIGUSR1)) {
+            ERR("kill");
+        }
+    }
+}
+
+// Signals are blocked outside sigsuspend, so the counter can be taken here.
+// End of stream signal is not blocked in the counting handler and can come
+// before messages still queued, those are taken after it
+
+long long signal_recv(int dir) {
+
+    sigset_t pending;
+    long long n;
+
+    if (sig_done) {
+
+        sigpending(&pending);
+
+        if (!sig_count && (sigismember(&pending, SIGUSR1) || sigismember(&pending, SIGRTMIN))) {
+            sigsuspend(&wait_mask);
+        }
+
+    } else if (!sig_count) {
+        sigsuspend(&wait_mask);
+    }
+
+    n = sig_count;
+    sig_count = 0;
+    return n;
+}
+
+void signal_finish(int dir) {
+    if (kill(peer, SIGUSR2)) {
+        ERR("kill");
+    }
+}
+
+// RT signals are queued, sigqueue fails with EAGAIN when the queue is full
+
+void rt_queue(int sig) {
+
+    union sigval value = {0};
+
+    while (sigqueue(peer, sig, value)) {
+        if (EAGAIN != errno) {
+            ERR("sigqueue");
+        }
+        sched_yield();
+    }
+}
+
+void rt_send(int dir, int count) {
+    for (int i = 0; i < count; i++) {
+        rt_queue(SIGRTMIN);
+    }
+}
+
+void rt_finish(int dir) {
+    rt_queue(SIGRTMIN + 1);
+}
+
+// Pipe: 8-byte records, a batch is one write
+
+void pipe_open(void) {
+    if (pipe(fds[0]) || pipe(fds[1])) {
+        ERR("pipe");
+    }
+}
+
+void pipe_send(int dir, int count) {
+
+    char buf[SEND_BATCH * MSG_SIZE] = {0};
+    size_t len = count * MSG_SIZE;
+    ssize_t n;
+
+    for (size_t off = 0; off < len; off += n) {
+        if ((n = write(fds[dir][1], buf + off, len - off)) < 0) {
+            ERR("write");
+        }
+    }
+}
+
+long long pipe_recv(int dir) {
+
+    char buf[4096];
+    ssize_t n;
+
+    if ((n = read(fds[dir][0], buf, sizeof(buf))) < 0) {
+        ERR("read");
+    }
+
+    pipe_rest += n;
+    n = pipe_rest / MSG_SIZE;
+    pipe_rest %= MSG_SIZE;
+    return n;
+}
+
+void fds_close(void) {
+    for (int dir = 0; dir < 2; dir++) {
+        close(fds[dir][0]);
+        if (fds[dir][1] != fds[dir][0]) {
+            close(fds[dir][1]);
+        }
+    }
+}
+
+// eventfd: one write per message, a read takes the sum
+
+void eventfd_open(void) {
+    for (int dir = 0; dir < 2; dir++) {
+        if ((fds[dir][0] = fds[dir][1] = eventfd(0, 0)) < 0) {
+            ERR("eventfd");
+        }
+    }
+}
+
+void eventfd_send(int dir, int count) {
+
+    uint64_t one = 1;
+
+    for (int i = 0; i < count; i++) {
+        if (write(fds[dir][1], &one, sizeof(one)) < 0) {
+            ERR("write");
+        }
+    }
+}
+
+long long eventfd_recv(int dir) {
+
+    uint64_t n;
+
+    if (read(fds[dir][0], &n, sizeof(n)) < 0) {
+        ERR("read");
+    }
+
+    return n;
+}
+
+// Futex: shared counter per direction, FUTEX_WAKE only when the receiver
+// announced it sleeps
+
+void futex_send(int dir, int count) {
+    for (int i = 0; i < count; i++) {
+
+        atomic_fetch_add(&sh->fx[dir].seq, 1);
+
+        if (atomic_load(&sh->fx[dir].waiting) && atomic_exchange(&sh->fx[dir].waiting, 0)) {
+            syscall(SYS_futex, &sh->fx[dir].seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+        }
+    }
+}
+
+long long futex_recv(int dir) {
+
+    uint32_t cur;
+    long long n;
+
+    while ((cur = atomic_load(&sh->fx[dir].seq)) == fx_seen[dir]) {
+
+        atomic_store(&sh->fx[dir].waiting, 1);
+
+        if (atomic_load(&sh->fx[dir].seq) == fx_seen[dir]) {
+            syscall(SYS_futex, &sh->fx[dir].seq, FUTEX_WAIT, fx_seen[dir], NULL, NULL, 0);
+        }
+    }
+
+    n = cur - fx_seen[dir];
+    fx_seen[dir] = cur;
+    return n;
+}
+
+// SOCK_SEQPACKET: a batch is one sendmmsg, receiving with recvmmsg
+
+void seqpacket_open(void) {
+
+    int sv[2];
+
+    for (int dir = 0; dir < 2; dir++) {
+
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv)) {
+            ERR("socketpair");
+        }
+
+        fds[dir][1] = sv[0];
+        fds[dir][0] = sv[1];
+    }
+}
+
+void seqpacket_send(int dir, int count) {
+
+    char buf[SEND_BATCH][MSG_SIZE] = {{0}};
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iov[SEND_BATCH];
+    int n;
+
+    memset(msgs, 0, sizeof(msgs));
+
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = buf[i];
+        iov[i].iov_len = MSG_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    for (int off = 0; off < count; off += n) {
+        if ((n = sendmmsg(fds[dir][1], msgs + off, count - off, 0)) < 0) {
+            ERR("sendmmsg");
+        }
+    }
+}
+
+long long seqpacket_recv(int dir) {
+
+    char buf[SEND_BATCH][MSG_SIZE];
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iov[SEND_BATCH];
+    int n;
+
+    memset(msgs, 0, sizeof(msgs));
+
+    for (int i = 0; i < SEND_BATCH; i++) {
+        iov[i].iov_base = buf[i];
+        iov[i].iov_len = MSG_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    if ((n = recvmmsg(fds[dir][0], msgs, SEND_BATCH, MSG_WAITFORONE, NULL)) < 0) {
+        ERR("recvmmsg");
+    }
+
+    return n;
+}
+
+// Shared-memory ring of shmring.h, 64-byte records
+
+void ring_open(void) {
+    for (int dir = 0; dir < 2; dir++) {
+        if (!(rings[dir] = ring_create(RING_RECORDS))) {
+            ERR("ring_create");
+        }
+    }
+}
+
+void ring_send(int dir, int count) {
+
+    static uint64_t seq = 0;
+    struct ring_rec recs[SEND_BATCH];
+    int32_t pid = getpid();
+
+    for (int i = 0; i < count; i++) {
+        recs[i].pid = pid;
+        recs[i].seq = seq++;
+        recs[i].len = 0;
+    }
+
+    ring_push_batch(rings[dir], recs, count);
+}
+
+long long ring_recv(int dir) {
+
+    struct ring_rec recs[RING_BATCH];
+    int n = ring_pop(rings[dir], recs, RING_BATCH);
+
+    if (!n) {
+        ring_wait(rings[dir]);
+    }
+
+    return n;
+}
+
+void ring_close_all(void) {
+    ring_destroy(rings[0]);
+    ring_destroy(rings[1]);
+}
+
+struct primitive primitives[] = {
+    {"signal", "signal", 1, NULL, signal_send, signal_recv, signal_finish, NULL},
+    {"rt", "signal", 1, NULL, rt_send, signal_recv, rt_finish, NULL},
+    {"pipe", "8 B", SEND_BATCH, pipe_open, pipe_send, pipe_recv, NULL, fds_close},
+    {"eventfd", "+1", 1, eventfd_open, eventfd_send, eventfd_recv, NULL, fds_close},
+    {"futex", "+1", 1, NULL, futex_send, futex_recv, NULL, NULL},
+    {"seqpacket", "packet", SEND_BATCH, seqpacket_open, seqpacket_send, seqpacket_recv, NULL, fds_close},
+    {"ring", "record", SEND_BATCH, ring_open, ring_send, ring_recv, NULL, ring_close_all},
+};
+
+#define PRIMITIVES ((int) (sizeof(primitives) / sizeof(primitives[0])))
+
+// CPU topology from sysfs, -1 when unknown
+
+int cpu_topology(int cpu, const char * what) {
+
+    char path[128];
+    FILE * f;
+    int v = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, what);
+
+    if ((f = fopen(path, "r"))) {
+        if (1 != fscanf(f, "%d", &v)) {
+            v = -1;
+        }
+        fclose(f);
+    }
+
+    return v;
+}
+
+// Picks parent and child CPU for a placement, returns -1 when the machine
+// (or the affinity mask we got) has no such pair. Sibling prefers another
+// core of the same package over a hyperthread of the same core
+
+int place_pair(int place, int * a, int * b) {
+
+    int cpus[CPU_SETSIZE], n = 0, smt = -1;
+
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &allowed)) {
+            cpus[n++] = i;
+        }
+    }
+
+    if (!n) {
+        return -1;
+    }
+
+    if (PLACE_SAME == place) {
+        *a = *b = cpus[0];
+        return 0;
+    }
+
+    for (int i = 0; i < n; i++) {
+        for (int j = i + 1; j < n; j++) {
+
+            int same_package = cpu_topology(cpus[i], "physical_package_id") == cpu_topology(cpus[j], "physical_package_id");
+            int same_core = same_package && cpu_topology(cpus[i], "core_id") == cpu_topology(cpus[j], "core_id");
+
+            if (PLACE_SOCKET == place && !same_package) {
+                *a = cpus[i];
+                *b = cpus[j];
+                return 0;
+            }
+
+            if (PLACE_SIBLING == place && same_package && !same_core) {
+                *a = cpus[i];
+                *b = cpus[j];
+                return 0;
+            }
+
+            if (PLACE_SIBLING == place && same_core && smt < 0) {
+                smt = i * CPU_SETSIZE + j;
+            }
+        }
+    }
+
+    if (PLACE_SIBLING == place && smt >= 0) {
+        *a = cpus[smt / CPU_SETSIZE];
+        *b = cpus[smt % CPU_SETSIZE];
+        return 0;
+    }
+
+    return -1;
+}
+
+void pin(int cpu) {
+
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set)) {
+        ERR("sched_setaffinity");
+    }
+}
+
+int compare_ll(const void * a, const void * b) {
+
+    long long x = *(const long long *) a, y = *(const long long *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+double percentile_us(long long * v, long long n, double p) {
+    return v[(long long) (p * (n - 1))] / 1000.0;
+}
+
+// Child side of a run
+
+void child_work(struct primitive * p, int pingpong, long long n, int cpu) {
+
+    long long got = 0, wakes = 0;
+
+    pin(cpu);
+    atomic_store(&sh->ready, 1);
+
+    if (!pingpong) {
+
+        while (got < n) {
+
+            long long k = p->recv(0);
+
+            got += k;
+            wakes += k > 0;
+
+            if (sig_done && !k) {
+                break;
+            }
+        }
+
+        sh->received = got;
+        sh->wakes = wakes;
+        sh->end_ns = now_ns();
+        return;
+    }
+
+    for (long long i = 0; i < n + WARMUP; i++) {
+        while (!p->recv(0));
+        p->send(1, 1);
+    }
+}
+
+// One child per test, it talks to the parent through peer
+
+void create_children(struct primitive * p, int pingpong, long long n, int cpu) {
+
+    fflush(stdout);
+
+    switch (peer = fork()) {
+        case 0:
+            peer = getppid();
+            child_work(p, pingpong, n, cpu);
+            exit(EXIT_SUCCESS);
+
+        case -1:
+            ERR("fork");
+    }
+}
+
+// Runs one test, returns one-way rate or fills latencies
+
+double run(struct primitive * p, int pingpong, long long n, int cpu_child, long long * lat, long long * received,
+           long long * wakes) {
+
+    long long start;
+    double rate = 0;
+
+    memset(sh, 0, sizeof(struct shared));
+    fx_seen[0] = fx_seen[1] = 0;
+    pipe_rest = 0;
+    sig_count = sig_done = 0;
+
+    if (p->open) {
+        p->open();
+    }
+
+    create_children(p, pingpong, n, cpu_child);
+
+    while (!atomic_load(&sh->ready)) {
+        sched_yield();
+    }
+
+    if (!pingpong) {
+
+        start = now_ns();
+
+        for (long long sent = 0, k; sent < n; sent += k) {
+            k = n - sent < p->batch ? n - sent : p->batch;
+            p->send(0, k);
+        }
+
+        if (p->finish) {
+            p->finish(0);
+        }
+
+    } else {
+
+        for (long long i = 0; i < n + WARMUP; i++) {
+
+            start = now_ns();
+            p->send(0, 1);
+            while (!p->recv(1));
+
+            if (i >= WARMUP) {
+                lat[i - WARMUP] = now_ns() - start;
+            }
+        }
+    }
+
+    if (waitpid(peer, NULL, 0) < 0) {
+        ERR("waitpid");
+    }
+
+    if (!pingpong) {
+        *received = sh->received;
+        *wakes = sh->wakes;
+        rate = sh->end_ns > start ? sh->received / ((sh->end_ns - start) / 1e9) : 0;
+    }
+
+    if (p->close) {
+        p->close();
+    }
+
+    return rate;
+}
+
+// Row of the table, BENCH_METRICS for the benchmark driver
+
+void report(struct primitive * p, int place, long long n, double rate, long long received, long long wakes,
+            long long * lat) {
+
+    char * path = getenv("BENCH_METRICS");
+    FILE * f;
+
+    qsort(lat, n, sizeof(long long), compare_ll);
+
+    double per_wake = wakes ? (double) received / wakes : 0;
+    double lost = 100.0 * (n - received) / n;
+    double rtt[5] = {percentile_us(lat, n, 0.5), percentile_us(lat, n, 0.9), percentile_us(lat, n, 0.99),
+                     percentile_us(lat, n, 0.999), lat[n - 1] / 1000.0};
+    const char * rtt_names[5] = {"p50", "p90", "p99", "p99_9", "max"};
+
+    printf("%-10s %-8s %-6s %5d %12.0f %8.1f %7.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n", p->name, place_names[place],
+           p->unit, p->batch, rate, per_wake, lost, rtt[0], rtt[1], rtt[2], rtt[3], rtt[4]);
+
+    if (!path || !(f = fopen(path, "a"))) {
+        return;
+    }
+
+    fprintf(f, "%s_%s_msgs_per_s %.0f\n%s_%s_msgs_per_wake %.1f\n%s_%s_lost_pct %.2f\n",
+            p->name, place_names[place], rate, p->name, place_names[place], per_wake, p->name, place_names[place], lost);
+
+    for (int i = 0; i < 5; i++) {
+        fprintf(f, "%s_%s_rtt_%s_us %.2f\n", p->name, place_names[place], rtt_names[i], rtt[i]);
+    }
+
+    fclose(f);
+}
+
+// Primitive and placement names given on command line exist
+
+int known(const char * only, const char * where) {
+
+    int p = !strcmp(only, "all"), q = !strcmp(where, "all");
+
+    for (int i = 0; i < PRIMITIVES; i++) {
+        p |= !strcmp(only, primitives[i].name);
+    }
+
+    for (int i = 0; i < PLACES; i++) {
+        q |= !strcmp(where, place_names[i]);
+    }
+
+    return p && q;
+}
+
+void usage(char * name) {
+
+    fprintf(stderr, "USAGE: %s [n [primitive [placement]]]\n", name);
+    fprintf(stderr, "n - messages of one-way test and round trips of ping-pong test (default %d)\n", DEFAULT_MESSAGES);
+    fprintf(stderr, "primitive - signal, rt, pipe, eventfd, futex, seqpacket, ring or all (default)\n");
+    fprintf(stderr, "placement - same (both on one CPU), sibling (two CPUs of one package),\n");
+    fprintf(stderr, "            socket (two packages) or all (default), missing ones are skipped\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char ** argv) {
+
+    long long n = DEFAULT_MESSAGES, received, wakes;
+    const char * only = argc > 2 ? argv[2] : "all";
+    const char * where = argc > 3 ? argv[3] : "all";
+    long long * lat;
+    sigset_t mask;
+    double rate;
+    int a, b;
+
+    if (argc > 4 || (argc > 1 && (n = atoll(argv[1])) <= 0) || !known(only, where)) {
+        usage(argv[0]);
+    }
+
+    if (!(lat = malloc(n * sizeof(long long)))) {
+        ERR("malloc");
+    }
+
+    sh = mmap(NULL, sizeof(struct shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (sh == MAP_FAILED) {
+        ERR("mmap");
+    }
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        ERR("sched_getaffinity");
+    }
+
+    // Signals are blocked except inside sigsuspend, children inherit both
+
+    setHandler(count_handler, SIGUSR1);
+    setHandler(count_handler, SIGRTMIN);
+    setHandler(done_handler, SIGUSR2);
+    setHandler(done_handler, SIGRTMIN + 1);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGRTMIN);
+    sigaddset(&mask, SIGRTMIN + 1);
+    sigprocmask(SIG_BLOCK, &mask, &wait_mask);
+
+    printf("%-10s %-8s %-6s %5s %12s %8s %7s %9s %9s %9s %9s %9s\n", "primitive", "place", "unit", "batch", "msgs/s",
+           "per wake", "lost %", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+
+    for (int place = 0; place < PLACES; place++) {
+
+        if (strcmp(where, "all") && strcmp(where, place_names[place])) {
+            continue;
+        }
+
+        if (place_pair(place, &a, &b)) {
+            printf("%-10s %-8s skipped, no such pair of CPUs available\n", "-", place_names[place]);
+            continue;
+        }
+
+        for (int i = 0; i < PRIMITIVES; i++) {
+
+            if (strcmp(only, "all") && strcmp(only, primitives[i].name)) {
+                continue;
+            }
+
+            pin(a);
+            rate = run(&primitives[i], 0, n, b, NULL, &received, &wakes);
+            run(&primitives[i], 1, n, b, lat, NULL, NULL);
+            report(&primitives[i], place, n, rate, received, wakes, lat);
+        }
+
+        // Back to the original mask so the next placement can use any CPU
+
+        sched_setaffinity(0, sizeof(allowed), &allowed);
+    }
+
+    free(lat);
+
+    return EXIT_SUCCESS;
+}
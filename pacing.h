@@ -0,0 +1,193 @@
+#ifndef PACING_H
+#define PACING_H
+
+// Pacing engine for signal producers. nanosleep alone can't hit intervals
+// below ~50us (timer slack + scheduler wake-up latency), so it offers:
+//
+//   legacy - relative nanosleep, exactly what the labs always did
+//   sleep  - clock_nanosleep to absolute deadlines, errors don't accumulate
+//   hybrid - sleeps until deadline minus calibrated margin, spins the rest
+//   spin   - busy-polls CLOCK_MONOTONIC, burns a whole CPU
+//
+// Mode is taken from PACE environment variable, so every program keeps its
+// arguments. When PACE is set the achieved interval (mean and jitter against
+// target) is printed to stderr once a second.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+
+#define PACE_LEGACY 0
+#define PACE_SLEEP 1
+#define PACE_HYBRID 2
+#define PACE_SPIN 3
+
+#define PACE_REPORT_NS 1000000000LL
+#define PACE_CALIBRATION_ROUNDS 20
+#define PACE_MAX_MARGIN_NS 200000LL
+
+struct pacer {
+    int mode;
+    int verbose;
+    long long interval_ns;
+    long long next_ns;
+    long long margin_ns;
+    long long last_ns;
+    long long last_report_ns;
+
+    // Achieved intervals since last report
+
+    long long count;
+    long long max;
+    double sum;
+    double sum_dev;
+};
+
+static const char * pace_names[] = {"legacy", "sleep", "hybrid", "spin"};
+
+static inline long long pace_now(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void pace_sleep_until(long long deadline) {
+
+    struct timespec ts = {deadline / 1000000000LL, deadline % 1000000000LL};
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+// Measures how late clock_nanosleep wakes up on this host, hybrid mode
+// wakes up that much earlier and spins the remaining time
+
+static inline long long pace_calibrate(void) {
+
+    long long worst = 0;
+
+    for (int i = 0; i < PACE_CALIBRATION_ROUNDS; i++) {
+
+        long long deadline = pace_now() + 50000;
+
+        pace_sleep_until(deadline);
+
+        long long late = pace_now() - deadline;
+
+        if (late > worst) {
+            worst = late;
+        }
+    }
+
+    return worst < PACE_MAX_MARGIN_NS ? worst : PACE_MAX_MARGIN_NS;
+}
+
+// Sets up pacer for given interval, mode comes from PACE (legacy if unset
+// or unknown). Timer slack is lowered to 1ns for the non-legacy modes
+
+static inline void pacer_init(struct pacer * pc, long long interval_ns) {
+
+    char * env = getenv("PACE");
+
+    memset(pc, 0, sizeof(struct pacer));
+    pc->interval_ns = interval_ns;
+    pc->verbose = env != NULL;
+
+    for (int i = PACE_SLEEP; env && i <= PACE_SPIN; i++) {
+        if (!strcmp(env, pace_names[i])) {
+            pc->mode = i;
+        }
+    }
+
+    if (pc->mode != PACE_LEGACY) {
+        prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+    }
+
+    if (PACE_HYBRID == pc->mode) {
+        pc->margin_ns = pace_calibrate();
+    }
+
+    pc->next_ns = pc->last_ns = pc->last_report_ns = pace_now();
+}
+
+static inline void pacer_report(struct pacer * pc) {
+
+    if (!pc->count) {
+        return;
+    }
+
+    // Jitter is mean absolute deviation of achieved interval from target
+
+    fprintf(stderr, "[%d] pacing %s: target %lld ns, mean %.0f ns, jitter %.0f ns, max %lld ns (%lld intervals)\n",
+            getpid(), pace_names[pc->mode], pc->interval_ns, pc->sum / pc->count,
+            pc->sum_dev / pc->count, pc->max, pc->count);
+
+    pc->count = pc->max = 0;
+    pc->sum = pc->sum_dev = 0;
+}
+
+// Waits for the next send slot and records the achieved interval
+
+static inline void pacer_wait(struct pacer * pc) {
+
+    long long now;
+
+    // No delay (m = 0 on transport paths): nothing to wait for or measure
+
+    if (!pc->interval_ns) {
+        return;
+    }
+
+    if (PACE_LEGACY == pc->mode) {
+
+        struct timespec t = {pc->interval_ns / 1000000000LL, pc->interval_ns % 1000000000LL};
+
+        nanosleep(&t, NULL);
+
+    } else {
+
+        // Falling behind by more than one interval, not trying to catch up
+
+        pc->next_ns += pc->interval_ns;
+        now = pace_now();
+
+        if (pc->next_ns < now - pc->interval_ns) {
+            pc->next_ns = now;
+        }
+
+        if (PACE_SLEEP == pc->mode) {
+            pace_sleep_until(pc->next_ns);
+        } else {
+
+            if (PACE_HYBRID == pc->mode && pc->next_ns - now > pc->margin_ns) {
+                pace_sleep_until(pc->next_ns - pc->margin_ns);
+            }
+
+            while (pace_now() < pc->next_ns);
+        }
+    }
+
+    now = pace_now();
+
+    long long interval = now - pc->last_ns;
+
+    pc->last_ns = now;
+    pc->count++;
+    pc->sum += interval;
+    pc->sum_dev += interval > pc->interval_ns ? interval - pc->interval_ns : pc->interval_ns - interval;
+
+    if (interval > pc->max) {
+        pc->max = interval;
+    }
+
+    if (pc->verbose && now - pc->last_report_ns >= PACE_REPORT_NS) {
+        pacer_report(pc);
+        pc->last_report_ns = now;
+    }
+}
+
+#endif
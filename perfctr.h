@@ -0,0 +1,240 @@
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+// Hot-path counters for the bulk I/O loops. A perf_event_open group
+// (cycles, instructions, cache misses, page faults, task clock) is read
+// around every bulk_read / bulk_write call and every block, together with
+// EINTR retries and short reads/writes, and reported per block and in
+// aggregate on stderr.
+//
+// Compiled in only with -DPERFCTR (make builds bin/prog16b_perf), otherwise
+// every macro below is empty or plain TEMP_FAILURE_RETRY, so the regular
+// binaries are exactly what they were. Counters the host doesn't have
+// (hardware ones in most VMs) are skipped and reported as "-".
+//
+// When BENCH_METRICS names a file, aggregate is also written there as
+// "key value" lines for the benchmark driver.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PC_EVENTS 5
+
+#define PC_READ_CALL 0
+#define PC_WRITE_CALL 1
+#define PC_BLOCK 2
+#define PC_SECTIONS 3
+
+struct pc_sample {
+    unsigned long long v[PC_EVENTS];
+    long long eintr;
+    long long shorts;
+};
+
+struct pc_stat {
+    struct pc_sample sum;
+    struct pc_sample last;
+    long long count;
+};
+
+#ifdef PERFCTR
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static const char * pc_event_names[PC_EVENTS] = {"cycles", "instructions", "cache-misses", "page-faults", "task-clock-ns"};
+static const char * pc_section_names[PC_SECTIONS] = {"read", "write", "block"};
+
+static const unsigned int pc_event_types[PC_EVENTS][2] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+};
+
+// Group leader fd, position of every event in group read (-1 if missing)
+
+static int pc_leader = -1;
+static int pc_slot[PC_EVENTS];
+static int pc_opened = 0;
+static long long pc_eintr = 0;
+static long long pc_shorts = 0;
+static struct pc_stat pc_stats[PC_SECTIONS];
+
+static inline int pc_open(unsigned int type, unsigned long long config, int group, int exclude_kernel) {
+
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = type;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+// Opens the group for the calling process. Kernel time is counted too (the
+// copies are the point), without permission for it only user space is
+
+static inline void pc_init(void) {
+
+    for (int i = 0; i < PC_EVENTS; i++) {
+
+        int fd = pc_open(pc_event_types[i][0], pc_event_types[i][1], pc_leader, 0);
+
+        if (fd < 0 && (EACCES == errno || EPERM == errno)) {
+            fd = pc_open(pc_event_types[i][0], pc_event_types[i][1], pc_leader, 1);
+        }
+
+        pc_slot[i] = fd < 0 ? -1 : pc_opened++;
+
+        if (fd >= 0 && pc_leader < 0) {
+            pc_leader = fd;
+        }
+    }
+
+    if (pc_leader < 0) {
+        fprintf(stderr, "[perf] no counters available: %s\n", strerror(errno));
+        return;
+    }
+
+    ioctl(pc_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(pc_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static inline void pc_read(struct pc_sample * s) {
+
+    unsigned long long buf[1 + PC_EVENTS];
+
+    memset(s, 0, sizeof(struct pc_sample));
+    s->eintr = pc_eintr;
+    s->shorts = pc_shorts;
+
+    if (pc_leader < 0 || read(pc_leader, buf, sizeof(buf)) < (ssize_t) sizeof(unsigned long long)) {
+        return;
+    }
+
+    for (int i = 0; i < PC_EVENTS; i++) {
+        if (pc_slot[i] >= 0 && (unsigned long long) pc_slot[i] < buf[0]) {
+            s->v[i] = buf[1 + pc_slot[i]];
+        }
+    }
+}
+
+static inline void pc_add(int section, struct pc_sample * a, struct pc_sample * b) {
+
+    struct pc_stat * st = &pc_stats[section];
+
+    for (int i = 0; i < PC_EVENTS; i++) {
+        st->last.v[i] = b->v[i] - a->v[i];
+        st->sum.v[i] += st->last.v[i];
+    }
+
+    st->last.eintr = b->eintr - a->eintr;
+    st->last.shorts = b->shorts - a->shorts;
+    st->sum.eintr += st->last.eintr;
+    st->sum.shorts += st->last.shorts;
+    st->count++;
+}
+
+static inline void pc_print(FILE * f, const char * section, struct pc_sample * s, long long div) {
+
+    fprintf(f, " %s:", section);
+
+    for (int i = 0; i < PC_EVENTS; i++) {
+        if (pc_slot[i] < 0) {
+            fprintf(f, " %s -", pc_event_names[i]);
+        } else {
+            fprintf(f, " %s %llu", pc_event_names[i], s->v[i] / div);
+        }
+    }
+
+    // Retries and short transfers are totals, means of those say little
+
+    if (1 == div) {
+        fprintf(f, " eintr %lld short %lld", s->eintr, s->shorts);
+    }
+}
+
+static inline void pc_block_report(int block) {
+
+    fprintf(stderr, "[perf] block %d", block);
+
+    for (int i = 0; i < PC_SECTIONS; i++) {
+        pc_print(stderr, pc_section_names[i], &pc_stats[i].last, 1);
+    }
+
+    fprintf(stderr, "\n");
+}
+
+// Totals and per-call means, then "key value" lines for the driver
+
+static inline void pc_report(void) {
+
+    char * path = getenv("BENCH_METRICS");
+    FILE * f;
+
+    for (int i = 0; i < PC_SECTIONS; i++) {
+
+        struct pc_stat * st = &pc_stats[i];
+
+        if (!st->count) {
+            continue;
+        }
+
+        fprintf(stderr, "[perf] total %lld %s", st->count, pc_section_names[i]);
+        pc_print(stderr, "sum", &st->sum, 1);
+        fprintf(stderr, "\n[perf] mean %lld %s", st->count, pc_section_names[i]);
+        pc_print(stderr, "per call", &st->sum, st->count);
+        fprintf(stderr, "\n");
+    }
+
+    if (!path || !(f = fopen(path, "a"))) {
+        return;
+    }
+
+    for (int i = 0; i < PC_SECTIONS; i++) {
+        for (int j = 0; j < PC_EVENTS; j++) {
+            if (pc_slot[j] >= 0) {
+                fprintf(f, "%s_%s %llu\n", pc_section_names[i], pc_event_names[j], pc_stats[i].sum.v[j]);
+            }
+        }
+    }
+
+    fprintf(f, "eintr %lld\nshort %lld\n", pc_stats[PC_BLOCK].sum.eintr, pc_stats[PC_BLOCK].sum.shorts);
+    fclose(f);
+}
+
+#define PC_INIT() pc_init()
+#define PC_SAMPLE(s) struct pc_sample s; pc_read(&s)
+#define PC_ADD(section, a, b) pc_add(section, &a, &b)
+#define PC_BLOCK_REPORT(block) pc_block_report(block)
+#define PC_REPORT() pc_report()
+#define PC_SHORT(done, wanted) do { if ((done) < (wanted)) pc_shorts++; } while (0)
+#define PC_RETRY(expression) \
+    (__extension__ ({ long int __result; \
+        while ((__result = (long int) (expression)) == -1L && EINTR == errno) pc_eintr++; \
+        __result; }))
+
+#else
+
+#define PC_INIT() do {} while (0)
+#define PC_SAMPLE(s) do {} while (0)
+#define PC_ADD(section, a, b) do {} while (0)
+#define PC_BLOCK_REPORT(block) do {} while (0)
+#define PC_REPORT() do {} while (0)
+#define PC_SHORT(done, wanted) do {} while (0)
+#define PC_RETRY(expression) TEMP_FAILURE_RETRY(expression)
+
+#endif
+
+#endif
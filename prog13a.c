@@ -9,6 +9,9 @@
 #include <string.h>
 #include <time.h>
 
+#include "vproc.h"
+#include "trace.h"
+
 #define ERR(source) (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
                     perror(source), kill(0, SIGKILL), \
                     exit(EXIT_FAILURE))
@@ -26,7 +29,7 @@ void child_work(int i) {
 
     // Providing seed to the random number generator
 
-    srand(time(NULL) * getpid());
+    srand(vp_time() * vp_getpid());
 
     // Generating pseudorandom number in [5, 10] range
 
@@ -34,9 +37,15 @@ void child_work(int i) {
 
     // Assigning process to sleep for t seconds
 
-    sleep(t);
+    vp_sleep(t);
+
+    printf("PROCESS with pid %d terminates\n", vp_getpid());
+}
+
+// Entry point of virtual children
 
-    printf("PROCESS with pid %d terminates\n", getpid());
+void child_start(void * arg) {
+    child_work((int) (long) arg);
 }
 
 // Function creating new processes
@@ -49,6 +58,13 @@ void create_children(int n) {
 
     for (n--; n >= 0; n--) {
 
+        // Virtual children (VPROC or VTIME set) are coroutines
+
+        if (vp_active()) {
+            vp_spawn(child_start, (void *) (long) n);
+            continue;
+        }
+
         // Checking if process was successfully created
         // Fork returns negative number if not
 
@@ -62,6 +78,8 @@ void create_children(int n) {
             child_work(n);
             exit(EXIT_SUCCESS);
         }
+
+        trace_fork(s);
     }
 }
 
@@ -85,22 +103,32 @@ int main(int argc, char ** argv) {
         usage(argv[0]);
     }
 
+    // Virtual processes, on the virtual clock with VTIME (see vtime.h)
+
+    if (vp_enabled()) {
+        vp_init();
+    }
+
+    // Binary event trace, only with TRACE set (see trace.h)
+
+    trace_init();
     create_children(n);
 
     // Parent process controls child processes
 
     while (n > 0) {
 
-        sleep(3);
+        vp_sleep(3);
         pid_t pid;
 
         for (;;) {
 
             // Will return process ID for which we're waiting
 
-            pid = waitpid(0, NULL, WNOHANG);
+            pid = vp_waitpid(0, NULL, WNOHANG);
 
             if (pid > 0) {
+                trace_reap(pid, 0);
                 n--;
             }
 
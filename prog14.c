@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -5,6 +6,12 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#include "vproc.h"
+#include "trace.h"
 
 #define ERR(source) (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
                     perror(source), kill(0, SIGKILL), \
@@ -14,12 +21,50 @@
 
 volatile sig_atomic_t last_signal = 0;
 
+// Wake-up latency bookkeeping shared between parent and children (MAP_SHARED).
+// Parent stores the send time of the last broadcast for every shard, each child
+// owns one wake_stat slot and wake_cap raw samples for percentiles
+
+struct wake_stat {
+    long long max_ns;
+    long long sum_ns;
+    long long count;
+};
+
+long long * shard_sent_ns = NULL;
+struct wake_stat * wake_stats = NULL;
+long long * wake_samples = NULL;
+long long wake_cap = 0;
+int my_shard = -1;
+int my_slot = -1;
+
+// Run queue is sampled by a separate process every RUNQ_PERIOD_NS, so
+// reading /proc/stat doesn't stretch the broadcast period being measured
+
+#define RUNQ_PERIOD_NS 500000
+
+volatile int * runq_peak = NULL;
+
+// Returns CLOCK_MONOTONIC time in nanoseconds (clock_gettime is async-signal-safe),
+// virtual time under VTIME
+
+long long now_ns(void) {
+    return vp_now();
+}
+
 void setHandler(void (*f)(int), int sigNo) {
 
     // This structure specifies how to handle a signal
 
     struct sigaction act;
 
+    // Virtual processes (VPROC set) keep their dispositions in the engine
+
+    if (vp_active()) {
+        vp_signal(sigNo, f);
+        return;
+    }
+
     // Copies '0' in each sizeof(struct sigaction) bytes in the structure above
 
     memset(&act, 0, sizeof(struct sigaction));
@@ -41,7 +86,26 @@ void setHandler(void (*f)(int), int sigNo) {
 // to a global variable
 
 void sig_handler(int sig) {
-    printf("[%d] received signal %d\n", getpid(), sig);
+
+    // Children record how long the signal took since the parent sent it to their shard
+
+    if (my_slot >= 0 && (sig == SIGUSR1 || sig == SIGUSR2)) {
+
+        long long lat = now_ns() - shard_sent_ns[my_shard];
+        struct wake_stat * ws = &wake_stats[my_slot];
+
+        if (lat > ws->max_ns) {
+            ws->max_ns = lat;
+        }
+        if (ws->count < wake_cap) {
+            wake_samples[my_slot * wake_cap + ws->count] = lat;
+        }
+        ws->sum_ns += lat;
+        ws->count++;
+    }
+
+    trace_signal(sig);
+    printf("[%d] received signal %d\n", vp_getpid(), sig);
     last_signal = sig;
 }
 
@@ -56,7 +120,13 @@ void sigchld_handler(int sig) {
 
         // Will return process ID for which we're waiting
 
-        pid = waitpid(0, NULL, WNOHANG);
+        // -1 instead of 0, because sharded children live in their own process groups
+
+        pid = waitpid(-1, NULL, WNOHANG);
+
+        if (pid > 0) {
+            trace_reap(pid, 0);
+        }
 
         // In case we can't get process status
 
@@ -81,7 +151,7 @@ void child_work(int l) {
 
     // Setting seed for random function
 
-    srand(getpid());
+    srand(vp_getpid());
 
     // Getting random value in range [5, 10]
 
@@ -93,30 +163,121 @@ void child_work(int l) {
 
         // Process sleeps for random time generated above
 
-        for (tt = t; tt > 0; tt = sleep(tt));
+        for (tt = t; tt > 0; tt = vp_sleep(tt));
 
         // Checking task conditions and informing about termination
 
         if (last_signal == SIGUSR1) {
-            printf("Success [%d]\n", getpid());
+            printf("Success [%d]\n", vp_getpid());
         } else {
-            printf("Failed [%d]\n", getpid());
+            printf("Failed [%d]\n", vp_getpid());
         }
 
-        printf("[%d] Terminates \n", getpid());
+        printf("[%d] Terminates \n", vp_getpid());
 
     }
 }
 
+// Reads number of currently runnable tasks in the whole system from /proc/stat
+
+int runnable_count(void) {
+
+    char line[256];
+    int running = -1;
+    FILE * f = fopen("/proc/stat", "r");
+
+    if (!f) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "procs_running %d", &running) == 1) {
+            break;
+        }
+    }
+
+    fclose(f);
+    return running;
+}
+
+// Sampler process: ignores the broadcast signals, keeps peak of run queue
+// in shared memory until the parent kills it
+
+pid_t start_runq_sampler(void) {
+
+    struct timespec ts = {0, RUNQ_PERIOD_NS};
+    pid_t pid;
+    int r;
+
+    switch (pid = fork()) {
+
+        case 0:
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            signal(SIGUSR1, SIG_IGN);
+            signal(SIGUSR2, SIG_IGN);
+
+            for (;;) {
+                if ((r = runnable_count()) > *runq_peak) {
+                    *runq_peak = r;
+                }
+                nanosleep(&ts, NULL);
+            }
+
+        case -1:
+            ERR("fork");
+    }
+
+    return pid;
+}
+
+void stop_runq_sampler(pid_t pid) {
+
+    // ECHILD: SIGCHLD handler was faster
+
+    kill(pid, SIGKILL);
+
+    if (waitpid(pid, NULL, 0) < 0 && errno != ECHILD) {
+        ERR("waitpid");
+    }
+}
+
+// Sends signal to one shard: whole process group (g == 0) or shard's group.
+// Send time is published before the signal so children can measure latency
+
+void send_shard(int g, pid_t * pgids, int shard, int sig) {
+
+    shard_sent_ns[shard] = now_ns();
+    trace_kill(g ? -pgids[shard] : 0, sig);
+
+    if (0 == g) {
+        if (vp_kill(0, sig) < 0) {
+            ERR("kill");
+        }
+    } else {
+
+        // ESRCH: every child of this shard has already terminated
+
+        if (vp_killpg(pgids[shard], sig) < 0 && errno != ESRCH) {
+            ERR("killpg");
+        }
+    }
+}
+
 // Parent process that send sequentially SIGUSR1 and SIGUSR2 to all
-// sub-processes in a loop with delays of k and p seconds
+// sub-processes in a loop with delays of k and p seconds. With g shards
+// every interval is split into g slices and one shard is signalled per slice,
+// so children wake up as a ramp instead of all at once
 
-void parent_work(int k, int p, int l) {
+void parent_work(int k, int p, int l, int g, pid_t * pgids) {
+
+    int shards = g ? g : 1;
 
     // Structures holding an interval broken down into seconds and nanoseconds
 
-    struct timespec tk = {k, 0};
-    struct timespec tp = {p, 0};
+    long long k_ns = k * 1000000000LL / shards;
+    long long p_ns = p * 1000000000LL / shards;
+    struct timespec tk = {k_ns / 1000000000LL, k_ns % 1000000000LL};
+    struct timespec tp = {p_ns / 1000000000LL, p_ns % 1000000000LL};
 
     // Sending SIGALRM to handle
 
@@ -124,54 +285,149 @@ void parent_work(int k, int p, int l) {
 
     // Function generating SIGALRM signal after l * 10 seconds
 
-    alarm(l * 10);
+    vp_alarm(l * 10);
 
     // While alarm hasn't yet been invoked...
 
     while (last_signal != SIGALRM) {
 
-        // Nanosleep handles delays
+        for (int j = 0; j < shards; j++) {
 
-        nanosleep(&tk, NULL);
+            // Nanosleep handles delays
 
-        // Sends signal SIGUSR1 to all sub-processes and checks correctness
+            vp_nanosleep(&tk, NULL);
 
-        if (kill(0, SIGUSR1) < 0) {
-            ERR("kill");
+            // Sends signal SIGUSR1 to all sub-processes (of the shard)
+
+            send_shard(g, pgids, j, SIGUSR1);
         }
 
-        nanosleep(&tp, NULL);
+        for (int j = 0; j < shards; j++) {
 
-        // Sends signal SIGUSR2 to all sub-processes and checks correctness
+            vp_nanosleep(&tp, NULL);
 
-        if (kill(0, SIGUSR2) < 0) {
-            ERR("kill");
+            // Sends signal SIGUSR2 to all sub-processes (of the shard)
+
+            send_shard(g, pgids, j, SIGUSR2);
         }
     }
 
     printf("[PARENT] Terminates \n");
+    printf("[PARENT] shards: %d, max runnable: %d\n", shards, *runq_peak);
+}
+
+// Prints wake-up latency summary gathered by children, p99 is taken over
+// all raw samples (mean and max also count samples above wake_cap)
+
+int cmp_ll(const void * a, const void * b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+void report_latency(int n) {
+
+    long long * samples = malloc(n * wake_cap * sizeof(long long));
+    long long sum = 0, count = 0, kept = 0, max = 0;
+
+    if (!samples) {
+        ERR("malloc");
+    }
+
+    for (int i = 0; i < n; i++) {
+
+        long long c = wake_stats[i].count < wake_cap ? wake_stats[i].count : wake_cap;
+
+        memcpy(samples + kept, wake_samples + i * wake_cap, c * sizeof(long long));
+        kept += c;
+        sum += wake_stats[i].sum_ns;
+        count += wake_stats[i].count;
+
+        if (wake_stats[i].max_ns > max) {
+            max = wake_stats[i].max_ns;
+        }
+    }
+
+    qsort(samples, kept, sizeof(long long), cmp_ll);
+
+    printf("[PARENT] wake-ups: %lld, mean: %lld us, p99: %lld us, max: %lld us\n",
+           count, count ? sum / count / 1000 : 0,
+           kept ? samples[(kept - 1) * 99 / 100] / 1000 : 0, max / 1000);
+
+    free(samples);
+}
+
+// Creates n children. With g > 0 child i joins process group of shard i % g,
+// the first child of each shard becomes group leader. setpgid is called both
+// in the child and in the parent so neither side races the other
+
+struct child_args {
+    int slot;
+    int l;
+    int g;
+    pid_t target;
+};
+
+// Everything child does after fork, also entry point of virtual children
+
+void child_start(void * arg) {
+
+    struct child_args * a = arg;
+
+    if (a->target >= 0 && vp_setpgid(0, a->target) < 0) {
+        ERR("setpgid");
+    }
+    my_slot = a->slot;
+    my_shard = a->g ? a->slot % a->g : 0;
+    setHandler(sig_handler, SIGUSR1);
+    setHandler(sig_handler, SIGUSR2);
+    child_work(a->l);
 }
 
-void create_children(int n, int l) {
+void create_children(int n, int l, int g, pid_t * pgids, struct child_args * args) {
+
+    pid_t pid, target;
 
     // Creating n children
 
-    while (n-- > 0) {
+    for (int i = 0; i < n; i++) {
+
+        target = g ? (i < g ? 0 : pgids[i % g]) : -1;
+        args[i] = (struct child_args) {i, l, g, target};
+
+        // Virtual children (VPROC set) are coroutines, the rest is the same
+
+        if (vp_active()) {
+            pid = vp_spawn(child_start, &args[i]);
+        } else {
+
+            // Checking if fork function has been successful
 
-        // Checking if fork function has been successful
+            switch(pid = fork()) {
 
-        switch(fork()) {
+                case 0:
+                    child_start(&args[i]);
+                    exit(EXIT_SUCCESS);
 
-            case 0:
-                setHandler(sig_handler, SIGUSR1);
-                setHandler(sig_handler, SIGUSR2);
-                child_work(l);
-                exit(EXIT_SUCCESS);
+                case -1:
+                    perror("Fork:");
+                    exit(EXIT_FAILURE);
 
-            case -1:
-                perror("Fork:");
-                exit(EXIT_FAILURE);
+            }
 
+            trace_fork(pid);
+        }
+
+        if (target >= 0) {
+
+            // EACCES: child already did it itself
+
+            if (vp_setpgid(pid, target ? target : pid) < 0 && errno != EACCES) {
+                ERR("setpgid");
+            }
+
+            if (i < g) {
+                pgids[i] = pid;
+            }
         }
     }
 }
@@ -180,22 +436,25 @@ void create_children(int n, int l) {
 
 void usage(void) {
 
-    fprintf(stderr, "USAGE: signals n k p l\n");
+    fprintf(stderr, "USAGE: signals n k p l [g]\n");
     fprintf(stderr,"n - number of children\n");
     fprintf(stderr, "k - Interval before SIGUSR1\n");
     fprintf(stderr, "p - Interval before SIGUSR2\n");
     fprintf(stderr, "l - lifetime of child in cycles\n");
+    fprintf(stderr, "g - optional number of process group shards [1, n], signals are staggered between shards\n");
     exit(EXIT_FAILURE);
 
 }
 
 int main(int argc, char ** argv) {
 
-    int n, k, p, l;
+    int n, k, p, l, g = 0;
+    pid_t * pgids = NULL;
+    struct child_args * args = NULL;
 
     // Checking correctness of arguments
 
-    if (argc != 5) {
+    if (argc != 5 && argc != 6) {
         usage();
     }
 
@@ -204,10 +463,57 @@ int main(int argc, char ** argv) {
     p = atoi(argv[3]);
     l = atoi(argv[4]);
 
+    if (argc == 6) {
+        g = atoi(argv[5]);
+        if (g <= 0 || g > n) {
+            usage();
+        }
+    }
+
     if (n <= 0 || k <= 0 || p <= 0 || l <= 0) {
         usage();
     }
 
+    // Binary event trace, only with TRACE set (see trace.h)
+
+    trace_init();
+
+    // Virtual processes (VPROC or VTIME set): per-process globals are swapped
+    // by the engine
+
+    if (vp_enabled()) {
+        vp_private((void *) &last_signal, sizeof(last_signal));
+        vp_private(&my_shard, sizeof(my_shard));
+        vp_private(&my_slot, sizeof(my_slot));
+        vp_init();
+    }
+
+    // Shared memory for latency measurement, visible to all children after fork.
+    // A child gets at most two signals per k + p round until the alarm
+
+    wake_cap = 2 * (l * 10 / (k + p) + 2);
+
+    size_t shm_size = (g ? g : 1) * sizeof(long long) + n * sizeof(struct wake_stat)
+                    + n * wake_cap * sizeof(long long) + sizeof(int);
+    void * shm = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (shm == MAP_FAILED) {
+        ERR("mmap");
+    }
+
+    shard_sent_ns = shm;
+    wake_stats = (struct wake_stat *) (shard_sent_ns + (g ? g : 1));
+    wake_samples = (long long *) (wake_stats + n);
+    runq_peak = (int *) (wake_samples + n * wake_cap);
+
+    if (g && !(pgids = calloc(g, sizeof(pid_t)))) {
+        ERR("calloc");
+    }
+
+    if (!(args = calloc(n, sizeof(struct child_args)))) {
+        ERR("calloc");
+    }
+
     // Setting handlers for different signals
 
     setHandler(sigchld_handler, SIGCHLD);
@@ -217,12 +523,31 @@ int main(int argc, char ** argv) {
     setHandler(SIG_IGN, SIGUSR1);
     setHandler(SIG_IGN, SIGUSR2);
 
-    create_children(n, l);
-    parent_work(k, p, l);
+    // Run queue means nothing on the virtual clock
+
+    pid_t sampler = vt_active() ? 0 : start_runq_sampler();
+
+    create_children(n, l, g, pgids, args);
+    parent_work(k, p, l, g, pgids);
+
+    if (sampler) {
+        stop_runq_sampler(sampler);
+    }
     
     // If the current process have no child processes wait(NULL) returns negative
 
-    while (wait(NULL) > 0);
+    pid_t pid;
+    int status;
+
+    while ((pid = vp_wait(&status)) > 0) {
+        trace_reap(pid, status);
+    }
+
+    report_latency(n);
+
+    free(pgids);
+    free(args);
+    munmap(shm, shm_size);
     return EXIT_SUCCESS;
 
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -5,15 +6,299 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdatomic.h>
+
+#include "pacing.h"
+#include "trace.h"
 
 #define ERR(source) (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
                     perror(source), kill(0, SIGKILL), \
                     exit(EXIT_FAILURE))
 
+// Transport modes selected by optional third argument
+
+#define MODE_PLAIN 0
+#define MODE_LATENCY 1
+#define MODE_RT 2
+#define MODE_SIGNALFD 3
+#define MODE_EVENTFD 4
+#define MODE_SHM 5
+#define MODE_ADAPTIVE 6
+
+// AIMD controller of adaptive mode: every tick rate grows by AIMD_INCREASE
+// events/s, on loss it is multiplied by AIMD_DECREASE
+
+#define AIMD_TICK_NS 10000000LL
+#define AIMD_REPORT_NS 500000000LL
+#define AIMD_INCREASE 500.0
+#define AIMD_DECREASE 0.5
+#define AIMD_MIN_RATE 100.0
+#define AIMD_MAX_RATE 1000000.0
+
+// Transports that don't use signals at all for events
+
+#define IS_TRANSPORT(mode) (MODE_EVENTFD == (mode) || MODE_SHM == (mode))
+
+#define CACHE_LINE 64
+
+// Maximum number of signalfd_siginfo records consumed by one read()
+
+#define SFD_BATCH 64
+
+// Benchmark: length of a single run and values of m it sweeps
+
+#define BENCH_NS 300000000LL
+#define BENCH_STEPS 11
+
+// HDR-style histogram: values below 2 * HIST_SUB are exact, above that every
+// power of two is split into HIST_SUB linear sub-buckets (~3% precision)
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS) * HIST_SUB)
+
+// Low 40 bits of sival_ptr carry send timestamp in ns (wraps every ~18 min),
+// upper 24 bits carry sequence number of the sender
+
+#define TS_BITS 40
+#define TS_MASK ((1LL << TS_BITS) - 1)
+#define SEQ_MASK ((1U << (64 - TS_BITS)) - 1)
+
+// Open-addressing table of senders keyed by pid, power of two and at least
+// twice MAX_PRODUCERS so probe chains stay short
+
+#define MAX_PRODUCERS 512
+#define SENDER_TABLE 1024
+
+struct histogram {
+    long long counts[HIST_BUCKETS];
+    long long total;
+};
+
+struct sender_stat {
+    pid_t pid;
+    unsigned int last_seq;
+    long long events;
+    long long boundaries;
+    long long received;
+    long long lost;
+};
+
 // Global variable used to exchange information in signal handling routing
 
 volatile sig_atomic_t last_signal = 0;
 
+// Counters shared with benchmark child (MAP_SHARED), NULL outside of benchmark
+
+struct bench_shared {
+    _Atomic long long sent;
+    _Atomic long long retries;
+
+    // Per producer, each on its own cache line
+
+    struct {
+        _Atomic pid_t pid;
+        _Atomic long long sent;
+    } __attribute__((aligned(CACHE_LINE))) producer[MAX_PRODUCERS];
+};
+
+int mode = MODE_PLAIN;
+
+char * mode_names[] = {"plain", "latency", "rt", "signalfd", "eventfd", "shm", "adaptive"};
+
+// Parent's consumed signal count published for adaptive producer
+
+struct ack_shared {
+    _Atomic long long consumed;
+};
+
+struct ack_shared * ack = NULL;
+
+// State of adaptive producer
+
+struct rate_state {
+    double rate;
+    double avg_rate;
+    long long lost;
+    long long last_tick;
+    long long last_report;
+    unsigned int sent_at_tick;
+    unsigned int sent_at_report;
+};
+
+// Counters of shm transport, each on its own cache line so producer's
+// increments don't bounce the line parent sleeps on. boundaries is also
+// the futex word, waiting tells producer that parent sleeps on it
+
+struct shm_counters {
+    _Atomic long long events __attribute__((aligned(CACHE_LINE)));
+    _Atomic unsigned int boundaries __attribute__((aligned(CACHE_LINE)));
+    _Atomic int waiting __attribute__((aligned(CACHE_LINE)));
+};
+
+// eventfd transport: events are aggregated by kernel in event_fd,
+// parent blocks only on boundary_fd
+
+int event_fd = -1;
+int boundary_fd = -1;
+struct shm_counters * counters = NULL;
+long long transport_events = 0;
+unsigned int transport_boundaries = 0;
+
+// Signals used as SIGUSR1/SIGUSR2 equivalents, real-time ones in rt mode
+// since those are queued instead of coalesced while pending
+
+int sig_event = SIGUSR1;
+int sig_boundary = SIGUSR2;
+
+volatile sig_atomic_t event_count = 0;
+volatile sig_atomic_t boundary_count = 0;
+
+struct bench_shared * bench = NULL;
+long long child_deadline = 0;
+
+// signalfd used instead of handlers in signalfd mode, and number of wakeup
+// syscalls the parent made (sigsuspend, read) for benchmark
+
+int sig_fd = -1;
+long long parent_syscalls = 0;
+
+// Per sender statistics, only touched by the handler and by parent while
+// SIGUSR1/SIGUSR2 are blocked
+
+struct sender_stat senders[SENDER_TABLE];
+int sender_count = 0;
+
+// Latency histograms by sender slot, allocated only for modes that queue
+// timestamps (latency, rt), the rest never pays for ~15 KB per slot
+
+struct histogram * sender_hists = NULL;
+
+// Number of producer children (K), index of this one in a producer child
+
+int producers = 1;
+int producer_index = 0;
+
+// Returns CLOCK_MONOTONIC time in nanoseconds (clock_gettime is async-signal-safe)
+
+long long now_ns(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int hist_index(long long v) {
+
+    if (v < 2 * HIST_SUB) {
+        return v < 0 ? 0 : v;
+    }
+
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int) ((v >> shift) - HIST_SUB);
+}
+
+long long hist_value(int i) {
+
+    if (i < 2 * HIST_SUB) {
+        return i;
+    }
+
+    return (long long) (HIST_SUB + i % HIST_SUB) << (i / HIST_SUB - 1);
+}
+
+void hist_record(struct histogram * h, long long v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+}
+
+// Returns smallest recorded value v such that fraction q of samples is <= v
+
+long long hist_percentile(struct histogram * h, double q) {
+
+    long long seen = 0;
+    long long rank = (long long) (q * h->total);
+
+    if (rank >= h->total) {
+        rank = h->total - 1;
+    }
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > rank) {
+            return hist_value(i);
+        }
+    }
+
+    return 0;
+}
+
+// Linear probing: slot holding pid or the empty one where it would go,
+// NULL when the table is full
+
+struct sender_stat * probe_sender(pid_t pid) {
+
+    unsigned int h = ((unsigned int) pid * 2654435761U) & (SENDER_TABLE - 1);
+
+    for (int i = 0; i < SENDER_TABLE; i++, h = (h + 1) & (SENDER_TABLE - 1)) {
+        if (senders[h].pid == pid || 0 == senders[h].pid) {
+            return &senders[h];
+        }
+    }
+
+    return NULL;
+}
+
+// Finds sender's slot, claims an empty one for a new pid. Table is
+// preallocated, so this is safe to call from a signal handler
+
+struct sender_stat * find_sender(pid_t pid) {
+
+    struct sender_stat * st = probe_sender(pid);
+
+    if (st && 0 == st->pid) {
+        st->pid = pid;
+        st->last_seq = SEQ_MASK;
+        sender_count++;
+    }
+
+    return st;
+}
+
+// Lookup only, for reports: a pid that delivered nothing gets no slot
+
+struct sender_stat * lookup_sender(pid_t pid) {
+
+    struct sender_stat * st = probe_sender(pid);
+
+    return st && st->pid == pid ? st : NULL;
+}
+
+void reset_senders(void) {
+
+    for (int i = 0; i < SENDER_TABLE; i++) {
+        if (senders[i].pid) {
+            memset(&senders[i], 0, sizeof(struct sender_stat));
+
+            if (sender_hists) {
+                memset(&sender_hists[i], 0, sizeof(struct histogram));
+            }
+        }
+    }
+
+    sender_count = 0;
+}
+
 void setHandler(void (*f)(int), int sigNo) {
 
     // This structure specifies how to handle a signal
@@ -39,7 +324,86 @@ void setHandler(void (*f)(int), int sigNo) {
 // Function handling given signal
 
 void sig_handler(int sig) {
+    trace_signal(sig);
     last_signal = sig;
+    if (sig == sig_event) {
+        event_count++;
+    } else if (sig == sig_boundary) {
+        boundary_count++;
+    }
+
+    // Lock-free atomic store is async-signal-safe
+
+    if (ack) {
+        atomic_store_explicit(&ack->consumed, event_count + boundary_count, memory_order_relaxed);
+    }
+}
+
+// SA_SIGINFO handler: counts signals per sender (si_pid), for sigqueue'd ones
+// also unpacks timestamp and sequence number from si_value, records latency
+// and sequence gaps
+
+void siginfo_handler(int sig, siginfo_t * info, void * ucontext) {
+
+    long long now = now_ns();
+    long long packed = (long long) (intptr_t) info->si_value.sival_ptr;
+    struct sender_stat * st;
+
+    sig_handler(sig);
+
+    if (!(st = find_sender(info->si_pid))) {
+        return;
+    }
+
+    if (sig == sig_event) {
+        st->events++;
+    } else if (sig == sig_boundary) {
+        st->boundaries++;
+    }
+
+    if (info->si_code != SI_QUEUE) {
+        return;
+    }
+
+    unsigned int seq = (unsigned long long) packed >> TS_BITS;
+
+    // Restoring full timestamp from its low bits, latency is far below wrap time
+
+    long long lat = (now - (packed & TS_MASK)) & TS_MASK;
+
+    // Difference of sequence numbers modulo 2^24, anything negative is a reorder
+
+    int gap = (int) ((seq - st->last_seq) & SEQ_MASK);
+
+    if (gap > 1 && gap < (int) (SEQ_MASK / 2)) {
+        st->lost += gap - 1;
+    }
+
+    if (gap < (int) (SEQ_MASK / 2)) {
+        st->last_seq = seq;
+    }
+
+    st->received++;
+
+    if (sender_hists) {
+        hist_record(&sender_hists[st - senders], lat);
+    }
+}
+
+void setSiginfoHandler(void (*f)(int, siginfo_t *, void *), int sigNo) {
+
+    struct sigaction act;
+
+    memset(&act, 0, sizeof(struct sigaction));
+
+    // SA_SIGINFO makes kernel pass siginfo_t with sender pid and si_value
+
+    act.sa_sigaction = f;
+    act.sa_flags = SA_SIGINFO;
+
+    if (-1 == sigaction(sigNo, &act, NULL)) {
+        ERR("sigaction");
+    }
 }
 
 // SIGCHLD signal is sent to a parent process sen child process stops or terminates.
@@ -55,6 +419,10 @@ void sigchld_handler(int sig) {
 
         pid = waitpid(0, NULL, WNOHANG);
 
+        if (pid > 0) {
+            trace_reap(pid, 0);
+        }
+
         // In case we can't get process status
 
         if (pid == 0) {
@@ -72,48 +440,486 @@ void sigchld_handler(int sig) {
     }
 }
 
+int futex(_Atomic unsigned int * uaddr, int op, unsigned int val, const struct timespec * timeout) {
+    return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+// Creates eventfd or shm transport, must be done before fork
+
+void transport_open(void) {
+
+    if (MODE_EVENTFD == mode) {
+
+        if ((event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            ERR("eventfd");
+        }
+
+        if ((boundary_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+            ERR("eventfd");
+        }
+    }
+
+    if (MODE_SHM == mode) {
+
+        counters = mmap(NULL, sizeof(struct shm_counters), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+        if (counters == MAP_FAILED) {
+            ERR("mmap");
+        }
+    }
+
+    transport_events = 0;
+    transport_boundaries = 0;
+}
+
+void transport_close(void) {
+
+    if (MODE_EVENTFD == mode) {
+        if (TEMP_FAILURE_RETRY(close(event_fd)) || TEMP_FAILURE_RETRY(close(boundary_fd))) {
+            ERR("close");
+        }
+    }
+
+    if (MODE_SHM == mode && munmap(counters, sizeof(struct shm_counters))) {
+        ERR("munmap");
+    }
+}
+
+// Producer side of eventfd/shm transports. In shm mode only the boundary may
+// cost a syscall, and only when parent actually sleeps
+
+void transport_send(int sig) {
+
+    if (MODE_EVENTFD == mode) {
+
+        uint64_t one = 1;
+
+        if (TEMP_FAILURE_RETRY(write(sig == sig_event ? event_fd : boundary_fd, &one, sizeof(one))) < 0) {
+            ERR("write");
+        }
+
+        return;
+    }
+
+    if (sig == sig_event) {
+        atomic_fetch_add_explicit(&counters->events, 1, memory_order_relaxed);
+        return;
+    }
+
+    atomic_fetch_add(&counters->boundaries, 1);
+
+    if (atomic_exchange(&counters->waiting, 0) && futex(&counters->boundaries, FUTEX_WAKE, 1, NULL) < 0) {
+        ERR("futex");
+    }
+}
+
+// Consumer side: sleeps until at least one SIGUSR2 equivalent arrives (or
+// timeout_ms passes, -1 = forever), refreshes transport_events and returns
+// number of new boundaries
+
+int transport_wait(int timeout_ms) {
+
+    unsigned int seen = transport_boundaries;
+    uint64_t v;
+
+    if (MODE_EVENTFD == mode) {
+
+        struct pollfd pfd = {boundary_fd, POLLIN, 0};
+
+        if (timeout_ms >= 0) {
+
+            parent_syscalls++;
+
+            if (TEMP_FAILURE_RETRY(poll(&pfd, 1, timeout_ms)) < 0) {
+                ERR("poll");
+            }
+        }
+
+        if (timeout_ms < 0 || pfd.revents & POLLIN) {
+
+            parent_syscalls++;
+
+            if (TEMP_FAILURE_RETRY(read(boundary_fd, &v, sizeof(v))) < 0) {
+                ERR("read");
+            }
+
+            transport_boundaries += v;
+        }
+
+        // One read returns all events counted since the previous one
+
+        parent_syscalls++;
+
+        if (TEMP_FAILURE_RETRY(read(event_fd, &v, sizeof(v))) < 0) {
+            if (errno != EAGAIN) {
+                ERR("read");
+            }
+        } else {
+            transport_events += v;
+        }
+
+    } else {
+
+        struct timespec timeout = {timeout_ms / 1000, timeout_ms % 1000 * 1000000L};
+
+        if (atomic_load(&counters->boundaries) == seen) {
+
+            // Announcing sleep before re-checking the word, futex itself
+            // refuses to sleep if producer changed it in between
+
+            atomic_store(&counters->waiting, 1);
+            parent_syscalls++;
+
+            if (futex(&counters->boundaries, FUTEX_WAIT, seen, timeout_ms >= 0 ? &timeout : NULL) < 0
+                && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+                ERR("futex");
+            }
+
+            atomic_store(&counters->waiting, 0);
+        }
+
+        transport_boundaries = atomic_load(&counters->boundaries);
+        transport_events = atomic_load_explicit(&counters->events, memory_order_relaxed);
+    }
+
+    // Counts stay in long long, event_count (sig_atomic_t) would wrap on long runs
+
+    return transport_boundaries - seen;
+}
+
+// Sends signal to parent. In latency and rt modes it is queued with sigqueue
+// carrying send timestamp and sequence number, otherwise plain kill is used
+
+void send_signal(int sig, unsigned int seq) {
+
+    if (IS_TRANSPORT(mode)) {
+        transport_send(sig);
+        return;
+    }
+
+    trace_kill(getppid(), sig);
+
+    if (MODE_PLAIN != mode && MODE_ADAPTIVE != mode) {
+
+        union sigval value;
+        long long packed = ((long long) (seq & SEQ_MASK) << TS_BITS) | (now_ns() & TS_MASK);
+        struct timespec backoff = {0, 10000};
+
+        value.sival_ptr = (void *) (intptr_t) packed;
+
+        // EAGAIN: parent's queue hit RLIMIT_SIGPENDING, waiting until it drains
+        // instead of dropping the signal
+
+        while (sigqueue(getppid(), sig, value)) {
+
+            if (errno != EAGAIN) {
+                ERR("sigqueue");
+            }
+
+            if (bench) {
+                bench->retries++;
+            }
+
+            nanosleep(&backoff, NULL);
+        }
+
+        return;
+    }
+
+    if (kill(getppid(), sig)) {
+        ERR("kill");
+    }
+}
+
+// AIMD step of adaptive mode, called after every send. Once per tick whatever
+// was sent before previous tick must have been consumed by now, anything
+// missing was coalesced (lost); a shortfall bigger than at the previous tick
+// halves the rate, otherwise rate grows. Loss is that shortfall taken anew
+// every tick, so signals merely late at one tick stop counting once acked.
+// Interval t is recomputed from the rate
+
+void rate_control(struct rate_state * rs, struct timespec * t, unsigned int sent) {
+
+    long long now = now_ns();
+
+    if (now - rs->last_tick < AIMD_TICK_NS) {
+        return;
+    }
+
+    long long consumed = atomic_load_explicit(&ack->consumed, memory_order_relaxed);
+    long long missing = (long long) rs->sent_at_tick - consumed;
+    long long deficit = missing - rs->lost;
+    double achieved = (sent - rs->sent_at_tick) * 1e9 / (now - rs->last_tick);
+
+    rs->lost = missing > 0 ? missing : 0;
+
+    if (deficit > 0) {
+        rs->rate *= AIMD_DECREASE;
+    } else if (achieved >= 0.75 * rs->rate) {
+
+        // Raising target only while producer keeps up with it, otherwise
+        // the limit is sleep granularity and not the consumer
+
+        rs->rate += AIMD_INCREASE;
+    } else {
+        rs->rate = achieved / 0.75;
+    }
+
+    if (rs->rate < AIMD_MIN_RATE) {
+        rs->rate = AIMD_MIN_RATE;
+    }
+
+    if (rs->rate > AIMD_MAX_RATE) {
+        rs->rate = AIMD_MAX_RATE;
+    }
+
+    // Average of the sawtooth is the sustainable rate the controller converges to
+
+    rs->avg_rate = 0.95 * rs->avg_rate + 0.05 * rs->rate;
+
+    long long interval = (long long) (1e9 / rs->rate);
+
+    t->tv_sec = interval / 1000000000LL;
+    t->tv_nsec = interval % 1000000000LL;
+
+    if (now - rs->last_report >= AIMD_REPORT_NS) {
+
+        printf("[%d] rate %.0f/s, converged %.0f/s, achieved %.0f/s, lost %lld\n",
+               getpid(), rs->rate, rs->avg_rate,
+               (sent - rs->sent_at_report) * 1e9 / (now - rs->last_report), rs->lost);
+        fflush(stdout);
+
+        rs->last_report = now;
+        rs->sent_at_report = sent;
+    }
+
+    rs->last_tick = now;
+    rs->sent_at_tick = sent;
+}
+
+// Delay between two sends through pacing engine (PACE environment variable).
+// Adaptive mode needs at least absolute deadlines so time spent sending
+// doesn't lower the rate controller asked for. m == 0 (eventfd/shm only)
+// gives zero interval, i.e. sending as fast as possible
+
+void child_sleep(struct timespec * t, struct pacer * pc) {
+
+    if (MODE_ADAPTIVE == mode && PACE_LEGACY == pc->mode) {
+        pc->mode = PACE_SLEEP;
+    }
+
+    pc->interval_ns = t->tv_sec * 1000000000LL + t->tv_nsec;
+    pacer_wait(pc);
+}
+
 void child_work(int m, int p) {
 
     int count = 0;
+    unsigned int seq = 0;
 
     // Structure holding an interval broken down into seconds and nanoseconds
 
     struct timespec t = {0, m * 10000};
 
+    // Adaptive mode starts from rate given by m
+
+    struct rate_state rs = {1e9 / (m ? m * 10000 : 1), 1e9 / (m ? m * 10000 : 1), 0, now_ns(), now_ns(), 0, 0};
+    struct pacer pc;
+
+    pacer_init(&pc, t.tv_nsec);
+
     while (1) {
 
         // Function sending p SIGUSR1 signals
 
         for (int i = 0; i < p; i++) {
 
-            // Nanosleep handles delays
+            // Pacing engine handles delays
 
-            nanosleep(&t, NULL);
+            child_sleep(&t, &pc);
 
             // Sending SIGUSR1 to parent and checking if everything went fine
 
-            if (kill(getppid(), SIGUSR1)) {
-                ERR("kill");
+            send_signal(sig_event, seq++);
+
+            if (MODE_ADAPTIVE == mode) {
+                rate_control(&rs, &t, seq);
+            }
+
+            if (bench) {
+                bench->sent++;
+                bench->producer[producer_index].sent++;
+            }
+
+            // Benchmark child runs only for a limited time
+
+            if (child_deadline && now_ns() >= child_deadline) {
+                return;
             }
         }
 
-        nanosleep(&t, NULL);
+        child_sleep(&t, &pc);
 
         // Sending SIGUSR2 to parent and checking if everything went fine
 
-        if (kill(getppid(), SIGUSR2)) {
-            ERR("kill");
-        }
+        send_signal(sig_boundary, seq++);
 
         count++;
-        printf("[%d] sent %d SIGUSR2\n", getpid(), count);
 
+        if (MODE_ADAPTIVE == mode) {
+            rate_control(&rs, &t, seq);
+        }
+
+        if (bench) {
+            bench->sent++;
+            bench->producer[producer_index].sent++;
+        } else if (MODE_ADAPTIVE != mode) {
+            printf("[%d] sent %d SIGUSR2\n", getpid(), count);
+        }
+
+    }
+}
+
+// Consumes one batch of pending signals from signalfd with a single read()
+// and updates counters in bulk. Returns number of SIGUSR2 equivalents read,
+// *child_died is set when SIGCHLD was among them
+
+int signalfd_batch(int * child_died) {
+
+    struct signalfd_siginfo buf[SFD_BATCH];
+    int events = 0, boundaries = 0;
+    ssize_t len;
+
+    if ((len = TEMP_FAILURE_RETRY(read(sig_fd, buf, sizeof(buf)))) < 0) {
+        ERR("read");
+    }
+
+    parent_syscalls++;
+
+    for (int i = 0; i < len / (ssize_t) sizeof(struct signalfd_siginfo); i++) {
+
+        struct sender_stat * st = find_sender(buf[i].ssi_pid);
+
+        trace_signal(buf[i].ssi_signo);
+
+        if ((int) buf[i].ssi_signo == sig_event) {
+            events++;
+            if (st) {
+                st->events++;
+            }
+        } else if ((int) buf[i].ssi_signo == sig_boundary) {
+            boundaries++;
+            if (st) {
+                st->boundaries++;
+            }
+        } else if (buf[i].ssi_signo == SIGCHLD && child_died) {
+            *child_died = 1;
+        }
+    }
+
+    event_count += events;
+    boundary_count += boundaries;
+    return boundaries;
+}
+
+// Fairness of producers by number of events: min/max ratio and Jain's index
+// (sum x)^2 / (n * sum x^2), 1.0 means perfectly fair
+
+void fairness(double * min_max, double * jain) {
+
+    double sum = 0, sum_sq = 0, min = -1, max = 0;
+    int n = 0;
+
+    // Single producer is fair by definition (and isn't tracked per pid in plain mode)
+
+    if (1 == producers) {
+        *min_max = *jain = 1.0;
+        return;
+    }
+
+    for (int i = 0; i < SENDER_TABLE; i++) {
+
+        double x = senders[i].events;
+
+        if (!senders[i].pid) {
+            continue;
+        }
+
+        sum += x;
+        sum_sq += x * x;
+        min = min < 0 || x < min ? x : min;
+        max = x > max ? x : max;
+        n++;
+    }
+
+    // Producers that never got through count as zero
+
+    for (; n < producers; n++) {
+        min = 0;
+    }
+
+    *min_max = max > 0 ? min / max : 0;
+    *jain = sum_sq > 0 ? sum * sum / (n * sum_sq) : 0;
+}
+
+// Prints aggregate rate and fairness of all producers
+
+void report_fairness(long long elapsed) {
+
+    double min_max, jain;
+
+    fairness(&min_max, &jain);
+    printf("[PARENT] %d producers: %.0f events/s, min/max %.3f, Jain %.3f\n",
+           producers, event_count * 1e9 / elapsed, min_max, jain);
+}
+
+// Prints latency percentiles and loss rate for every sender seen so far
+
+void report_latency(void) {
+
+    for (int i = 0; i < SENDER_TABLE; i++) {
+
+        struct sender_stat * st = &senders[i];
+
+        if (!st->pid || !st->received || !sender_hists) {
+            continue;
+        }
+
+        printf("[PARENT] sender %d: rx %lld, lost %lld (%.2f%%), p50 %lld ns, p99 %lld ns, p99.9 %lld ns\n",
+               st->pid, st->received, st->lost,
+               100.0 * st->lost / (st->received + st->lost),
+               hist_percentile(&sender_hists[i], 0.5),
+               hist_percentile(&sender_hists[i], 0.99),
+               hist_percentile(&sender_hists[i], 0.999));
     }
 }
 
 void parent_work(sigset_t oldMask) {
 
     int count = 0;
+    long long start = now_ns();
+    long long last_report = start;
+
+    while (IS_TRANSPORT(mode)) {
+
+        // Parent sleeps in the kernel until a boundary, events are aggregated
+
+        for (int b = transport_wait(-1); b > 0; b--) {
+            count++;
+            printf("[PARENT] received %d SIGUSR2 (%lld events)\n", count, transport_events);
+        }
+    }
+
+    while (MODE_SIGNALFD == mode) {
+
+        // Signals stay blocked, every wakeup drains all that is pending
+
+        for (int b = signalfd_batch(NULL); b > 0; b--) {
+            count++;
+            printf("[PARENT] received %d SIGUSR2 (%d events)\n", count, event_count);
+        }
+    }
 
     while (1) {
 
@@ -121,27 +927,340 @@ void parent_work(sigset_t oldMask) {
 
         // Checking if last received signal is SIGUSR2
 
-        while (last_signal != SIGUSR2) {
+        while (last_signal != sig_boundary) {
 
             // Replaces current mask with oldMask, wait until signal from
             // oldMask shows up
 
             sigsuspend(&oldMask);
+            parent_syscalls++;
+
+            // Signals are blocked here again, so handler can't touch stats
+
+            if (now_ns() - last_report >= 1000000000LL) {
+
+                if (MODE_LATENCY == mode || MODE_RT == mode) {
+                    report_latency();
+                }
+
+                if (producers > 1) {
+                    report_fairness(now_ns() - start);
+                }
+
+                last_report = now_ns();
+            }
         }
 
         count++;
-        printf("[PARENT] received %d SIGUSR2\n", count);
+
+        if (MODE_RT == mode) {
+            printf("[PARENT] received %d SIGUSR2 (%d events)\n", count, event_count);
+        } else {
+            printf("[PARENT] received %d SIGUSR2\n", count);
+        }
 
     }
 }
 
+// Sets handlers and blocks signals of current mode, returns previous mask
+
+sigset_t install_handlers(void) {
+
+    sigset_t mask, oldMask;
+
+    sig_event = MODE_RT == mode ? SIGRTMIN : SIGUSR1;
+    sig_boundary = MODE_RT == mode ? SIGRTMIN + 1 : SIGUSR2;
+
+    // Latency histograms on first use of a timestamped mode, before any
+    // handler can record into them
+
+    if ((MODE_LATENCY == mode || MODE_RT == mode) && !sender_hists
+        && !(sender_hists = calloc(SENDER_TABLE, sizeof(struct histogram)))) {
+        ERR("calloc");
+    }
+
+    // Telling producers apart needs si_pid, hence SA_SIGINFO
+
+    if (MODE_PLAIN == mode && 1 == producers) {
+        setHandler(sig_handler, sig_event);
+        setHandler(sig_handler, sig_boundary);
+    } else {
+        setSiginfoHandler(siginfo_handler, sig_event);
+        setSiginfoHandler(siginfo_handler, sig_boundary);
+    }
+
+    // Initializing and emptying mask set
+
+    sigemptyset(&mask);
+
+    // Adding elements to set, SIGCHLD too so benchmark can't miss child's death
+
+    sigaddset(&mask, sig_event);
+    sigaddset(&mask, sig_boundary);
+    sigaddset(&mask, SIGCHLD);
+
+    // Changing blocked set to mask, saving old in oldMask
+    // Argument SIG_BLOCK: The resulting set shall be the union of the current set and
+    //                     the signal set pointed to by set.
+
+    sigprocmask(SIG_BLOCK, &mask, &oldMask);
+
+    // In signalfd mode handlers are never run, pending signals are read from fd.
+    // Called again for every K step, the existing fd is reused then
+
+    if (MODE_SIGNALFD == mode && (sig_fd = signalfd(sig_fd, &mask, SFD_CLOEXEC)) < 0) {
+        ERR("signalfd");
+    }
+
+    return oldMask;
+}
+
+// Returns 1 while any child is alive, reaping those that are not.
+// sigchld_handler may have reaped them already, then waitpid says ECHILD
+
+int children_alive(void) {
+
+    pid_t r;
+
+    while ((r = waitpid(-1, NULL, WNOHANG)) > 0) {
+        trace_reap(r, 0);
+    }
+
+    if (r < 0 && errno != ECHILD) {
+        ERR("waitpid");
+    }
+
+    return 0 == r;
+}
+
+// Forks k producers running child_work
+
+void create_children(int k, int m, int p) {
+
+    pid_t pid;
+
+    while (k-- > 0) {
+        switch (pid = fork()) {
+            case 0:
+                producer_index = k;
+
+                if (bench) {
+                    bench->producer[k].pid = getpid();
+                }
+
+                child_work(m, p);
+                exit(EXIT_SUCCESS);
+
+            case -1:
+                ERR("fork");
+        }
+
+        trace_fork(pid);
+    }
+}
+
+// Row of every producer under the K step: sent, delivered and rate.
+// eventfd and shm don't know who sent what, delivered stays empty there,
+// as for a single plain producer (counted without si_pid)
+
+void report_producers(long long elapsed) {
+
+    int tracked = !IS_TRANSPORT(mode) && !(MODE_PLAIN == mode && 1 == producers);
+
+    for (int i = 0; i < producers; i++) {
+
+        struct sender_stat * st = tracked ? lookup_sender(bench->producer[i].pid) : NULL;
+        long long sent = bench->producer[i].sent;
+
+        if (tracked) {
+            long long delivered = st ? st->events + st->boundaries : 0;
+
+            printf("%-8s %9d %10lld %10lld %10lld %12.0f\n", "  pid", (int) bench->producer[i].pid, sent,
+                   delivered, sent - delivered, delivered * 1e9 / elapsed);
+        } else {
+            printf("%-8s %9d %10lld %10s %10s %12s\n", "  pid", (int) bench->producer[i].pid, sent, "-", "-", "-");
+        }
+    }
+}
+
+// Runs producers for BENCH_NS with given m and counts what reached the parent
+
+void bench_run(int m, int p, sigset_t oldMask) {
+
+    sigset_t cur, pending;
+    long long start;
+    struct rusage ru_start, ru_end;
+    double min_max, jain;
+
+    memset(bench, 0, sizeof(struct bench_shared));
+    reset_senders();
+    event_count = boundary_count = 0;
+    parent_syscalls = 0;
+
+    // Flushing so child doesn't inherit and print again buffered table
+
+    fflush(stdout);
+
+    transport_open();
+
+    start = now_ns();
+    child_deadline = start + BENCH_NS;
+    getrusage(RUSAGE_SELF, &ru_start);
+
+    create_children(producers, m, p);
+
+    if (IS_TRANSPORT(mode)) {
+
+        // Waking up at least every 10 ms to notice children's death
+
+        do {
+            transport_wait(10);
+        } while (children_alive());
+
+        transport_wait(0);
+
+    } else if (MODE_SIGNALFD == mode) {
+
+        // SIGCHLD comes through signalfd as well, afterwards draining what
+        // is still pending without blocking
+
+        while (children_alive()) {
+            signalfd_batch(NULL);
+        }
+
+        while (!sigpending(&pending) && (sigismember(&pending, sig_event) || sigismember(&pending, sig_boundary))) {
+            signalfd_batch(NULL);
+        }
+
+    } else {
+
+        // Waiting for children's death
+
+        while (children_alive()) {
+            sigsuspend(&oldMask);
+            parent_syscalls++;
+        }
+
+        // Unblocking for a moment delivers whatever is still pending
+
+        sigprocmask(SIG_SETMASK, &oldMask, &cur);
+        sigprocmask(SIG_SETMASK, &cur, NULL);
+    }
+
+    getrusage(RUSAGE_SELF, &ru_end);
+
+    long long elapsed = now_ns() - start;
+    long long delivered = IS_TRANSPORT(mode) ? transport_events + transport_boundaries
+                                             : (long long) event_count + boundary_count;
+    long long cpu_us = (ru_end.ru_utime.tv_sec - ru_start.ru_utime.tv_sec) * 1000000LL
+                     + (ru_end.ru_utime.tv_usec - ru_start.ru_utime.tv_usec)
+                     + (ru_end.ru_stime.tv_sec - ru_start.ru_stime.tv_sec) * 1000000LL
+                     + (ru_end.ru_stime.tv_usec - ru_start.ru_stime.tv_usec);
+
+    // Every handler run costs rt_sigreturn on top of the wakeup syscall
+
+    long long syscalls = parent_syscalls + (MODE_SIGNALFD == mode || IS_TRANSPORT(mode) ? 0 : delivered);
+
+    long long sent = bench->sent;
+
+    fairness(&min_max, &jain);
+
+    // eventfd and shm don't know who sent what, fairness can't be measured there
+
+    printf("%-8s %4d %4d %10lld %10lld %10lld %12.0f %8lld %8.2f %6.1f %7.3f %6.3f\n",
+           mode_names[mode], m, producers, sent, delivered,
+           sent - delivered, delivered * 1e9 / elapsed, (long long) bench->retries,
+           delivered ? (double) syscalls / delivered : 0.0, cpu_us * 1e5 / elapsed,
+           IS_TRANSPORT(mode) ? 0.0 : min_max, IS_TRANSPORT(mode) ? 0.0 : jain);
+
+    if (producers > 1) {
+        report_producers(elapsed);
+    }
+
+    transport_close();
+}
+
+// Sweeps m up to max_m for every mode, or with max_k > 0 number of
+// producers 1, 2, 4, ... up to max_k at fixed m
+
+void bench_work(int max_m, int p, int max_k) {
+
+    int steps[BENCH_STEPS] = {0, 1, 2, 5, 10, 20, 50, 100, 200, 500, 999};
+    int modes[5] = {MODE_PLAIN, MODE_RT, MODE_SIGNALFD, MODE_EVENTFD, MODE_SHM};
+    struct rlimit rl;
+
+    bench = mmap(NULL, sizeof(struct bench_shared), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (bench == MAP_FAILED) {
+        ERR("mmap");
+    }
+
+    if (getrlimit(RLIMIT_SIGPENDING, &rl)) {
+        ERR("getrlimit");
+    }
+
+    printf("RLIMIT_SIGPENDING: %ld\n", (long) rl.rlim_cur);
+    printf("%-8s %4s %4s %10s %10s %10s %12s %8s %8s %6s %7s %6s\n",
+           "mode", "m", "K", "sent", "delivered", "lost", "events/s", "eagain", "sys/sig", "cpu%",
+           "min/max", "jain");
+
+    for (int i = 0; i < 5; i++) {
+
+        mode = modes[i];
+        sigset_t oldMask = install_handlers();
+
+        if (max_k > 0) {
+
+            for (producers = 1; producers <= max_k; producers *= 2) {
+
+                // Handler depends on number of producers
+
+                sigprocmask(SIG_SETMASK, &oldMask, NULL);
+                install_handlers();
+
+                if (0 == max_m && !IS_TRANSPORT(mode)) {
+                    break;
+                }
+
+                bench_run(max_m, p, oldMask);
+            }
+
+        } else {
+
+            // m == 0 (no delay at all) makes sense only without signals
+
+            for (int j = IS_TRANSPORT(mode) ? 0 : 1; j < BENCH_STEPS && steps[j] <= max_m; j++) {
+                bench_run(steps[j], p, oldMask);
+            }
+        }
+
+        if (sig_fd >= 0 && TEMP_FAILURE_RETRY(close(sig_fd))) {
+            ERR("close");
+        }
+
+        sig_fd = -1;
+        sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    }
+
+    munmap(bench, sizeof(struct bench_shared));
+}
+
 // Error printing function
 
 void usage(char * name) {
 
-    fprintf(stderr, "USAGE: %s m p\n", name);
+    fprintf(stderr, "USAGE: %s m p [mode [K]]\n", name);
     fprintf(stderr,"m - number of 1/1000 miliseconds between signals [1, 999], i.e. one milisecond maximum\n");
+    fprintf(stderr, "    (0 allowed in eventfd and shm modes: no delay)\n");
     fprintf(stderr, "p - after p SIGUSR1 send one SIGUSR2 [1, 999]\n");
+    fprintf(stderr, "mode - optional: plain (default), latency (sigqueue timestamps, reports p50/p99/p99.9 and loss),\n");
+    fprintf(stderr, "       rt (queued SIGRTMIN/SIGRTMIN+1, no coalescing), signalfd (blocked signals read in batches),\n");
+    fprintf(stderr, "       eventfd (events summed by kernel counter), shm (padded atomic counters + futex),\n");
+    fprintf(stderr, "       adaptive (AIMD producer searching for highest loss-free rate, parent acks via shm),\n");
+    fprintf(stderr, "       bench (all of the above except latency and adaptive for m up to given m,\n");
+    fprintf(stderr, "       or with K for 1, 2, 4, ... K producers at given m)\n");
+    fprintf(stderr, "K - number of producers [1, %d], not for adaptive mode\n", MAX_PRODUCERS);
     exit(EXIT_FAILURE);
 
 }
@@ -150,63 +1269,88 @@ int main(int argc, char ** argv) {
 
     int m, p;
 
-    if (argc != 3) {
+    if (argc < 3 || argc > 5) {
         usage(argv[0]);
     }
 
+    if (argc == 5) {
+        producers = atoi(argv[4]);
+        if (producers <= 0 || producers > MAX_PRODUCERS) {
+            usage(argv[0]);
+        }
+    }
+
     m = atoi(argv[1]);
     p = atoi(argv[2]);
 
-    if (m <= 0 || m > 999 || p <= 0 || p > 999) {
+    if (m < 0 || m > 999 || p <= 0 || p > 999) {
+        usage(argv[0]);
+    }
+
+    // Binary event trace, only with TRACE set (see trace.h)
+
+    trace_init();
+
+    if (argc >= 4) {
+        if (!strcmp(argv[3], "latency")) {
+            mode = MODE_LATENCY;
+        } else if (!strcmp(argv[3], "rt")) {
+            mode = MODE_RT;
+        } else if (!strcmp(argv[3], "signalfd")) {
+            mode = MODE_SIGNALFD;
+        } else if (!strcmp(argv[3], "eventfd")) {
+            mode = MODE_EVENTFD;
+        } else if (!strcmp(argv[3], "shm")) {
+            mode = MODE_SHM;
+        } else if (!strcmp(argv[3], "adaptive")) {
+            mode = MODE_ADAPTIVE;
+        } else if (!strcmp(argv[3], "bench")) {
+            setHandler(sigchld_handler, SIGCHLD);
+            bench_work(m, p, argc == 5 ? producers : 0);
+            return EXIT_SUCCESS;
+        } else if (strcmp(argv[3], "plain")) {
+            usage(argv[0]);
+        }
+    }
+
+    if ((0 == m && !IS_TRANSPORT(mode)) || (MODE_ADAPTIVE == mode && producers > 1)) {
         usage(argv[0]);
     }
 
     // Setting handlers for signals
 
     setHandler(sigchld_handler, SIGCHLD);
-    setHandler(sig_handler, SIGUSR1);
-    setHandler(sig_handler, SIGUSR2);
+    sigset_t oldMask = install_handlers();
 
-    // Creating new signal sets
+    transport_open();
 
-    sigset_t mask, oldMask;
+    // Shared consumed counter, child reads it to detect lost signals
 
-    // Initializing and emptying mask set
+    if (MODE_ADAPTIVE == mode) {
 
-    sigemptyset(&mask);
+        ack = mmap(NULL, sizeof(struct ack_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
 
-    // Adding elements to set
+        if (ack == MAP_FAILED) {
+            ERR("mmap");
+        }
+    }
 
-    sigaddset(&mask, SIGUSR1);
-    sigaddset(&mask, SIGUSR2);
+    // Creating producers, parent goes to work
 
-    // Changing blocked set to mask, saving old in oldMask
-    // Argument SIG_BLOCK: The resulting set shall be the union of the current set and
-    //                     the signal set pointed to by set.
-
-    sigprocmask(SIG_BLOCK, &mask, &oldMask);
+    create_children(producers, m, p);
+    parent_work(oldMask);
 
     pid_t pid;
+    int status;
 
-    // Creating new process and checking correctness of operation
-
-    if ((pid = fork()) < 0) {
-        ERR("fork");
-    }
-
-    // If successful, send children to work, else parent goes to work
-
-    if (0 == pid) {
-        child_work(m, p);
-    } else {
-        parent_work(oldMask);
-        while (wait(NULL) > 0);
+    while ((pid = wait(&status)) > 0) {
+        trace_reap(pid, status);
     }
 
     // Argument SIG_UNBLOCK: The resulting set shall be the union of the current set and
     //                       the signal set pointed to by set.
 
-    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
     return EXIT_SUCCESS;
 
 }
@@ -8,6 +8,11 @@
 #include <time.h>
 #include <fcntl.h>
 
+#include "autotune.h"
+#include "bufalloc.h"
+#include "pacing.h"
+#include "trace.h"
+
 #define ERR(source) (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
                     perror(source), kill(0, SIGKILL), \
                     exit(EXIT_FAILURE))
@@ -41,14 +46,17 @@ void setHandler(void (*f)(int), int sigNo) {
 // Function handling given signal
 
 void sig_handler(int sig) {
+    trace_signal(sig);
     sig_count++;
 }
 
 void child_work(int m) {
 
-    // Structure holding an interval broken down into seconds and nanoseconds
+    // Pacer sending every m * 10 microseconds (see pacing.h, PACE variable)
+
+    struct pacer pc;
 
-    struct timespec t = {0, m * 10000};
+    pacer_init(&pc, m * 10000);
 
     // We are setting SIG_DFL default handler for SIGUSR1 signal
 
@@ -56,25 +64,67 @@ void child_work(int m) {
 
     while (1) {
 
-        // Nanosleep handles delays
+        // Pacing engine handles delays
 
-        nanosleep(&t, NULL);
+        pacer_wait(&pc);
 
         // Sending SIGUSR1 to parent and checking if everything went fine
 
+        trace_kill(getppid(), SIGUSR1);
+
         if (kill(getppid(), SIGUSR1)) {
             ERR("kill");
         }
     }
 }
 
-void parent_work(int b, int s, char * name) {
+// Chunk size tuner (--auto, see autotune.h)
+
+struct autotune tune;
+
+// One block in tuned chunks, a read and a write call each. As in the fixed
+// size loop below, a short read ends the block. Returns bytes written
+
+ssize_t block_auto(int in, int out, char * buf, size_t count) {
+
+    ssize_t c;
+    ssize_t len = 0;
+    size_t n;
+    long long start;
+
+    while (count > 0) {
+
+        n = count < at_chunk(&tune) ? count : at_chunk(&tune);
+        start = at_now();
+
+        if ((c = read(in, buf, n)) < 0) {
+            ERR("read");
+        }
+
+        if ((c = write(out, buf, c)) < 0) {
+            ERR("write");
+        }
+
+        at_record(&tune, c, at_now() - start);
+        len += c;
+
+        if ((size_t) c < n) {
+            break;
+        }
+
+        count -= c;
+    }
+
+    return len;
+}
+
+void parent_work(int b, int s, char * name, int autotune) {
 
     int i, in, out;
     ssize_t count;
-    char * buf = malloc(s);
+    char * buf = buf_get(s);
 
-    // Checking malloc correctness
+    // Checking malloc correctness (huge page buffer with HUGEBUF, bufalloc.h)
 
     if (!buf) {
         ERR("malloc");
@@ -94,22 +144,37 @@ void parent_work(int b, int s, char * name) {
         ERR("open");
     }
 
+    if (autotune) {
+        at_init(&tune, s, out);
+    }
+
     // b == amount of blocks of set size
 
+    buf_loop_begin();
+
     for (i = 0; i < b; i++) {
 
+        long long block_ns = buf_block_begin();
+
+        trace_io_begin(i, s);
+
         // Function reads s bytes from input and puts them in buffer
 
-        if ((count = read(in, buf, s)) < 0) {
+        if (tune.on) {
+            count = block_auto(in, out, buf, s);
+        } else if ((count = read(in, buf, s)) < 0) {
             ERR("read");
         }
 
         // Writes count bytes from buffer to out
 
-        if ((count = write(out, buf, count)) < 0) {
+        if (!tune.on && (count = write(out, buf, count)) < 0) {
             ERR("write");
         }
 
+        trace_io_end(i, count);
+        buf_block(block_ns);
+
         // Informing about operation by stderr
 
         if (fprintf(stderr, "Blocks %ld bytes transferred. Signals RX:%d\n", count, sig_count) < 0) {
@@ -127,10 +192,17 @@ void parent_work(int b, int s, char * name) {
         ERR("close");
     }
 
-    free(buf);
+    buf_report();
+    buf_free(buf);
+
+    if (tune.on) {
+        at_finish(&tune);
+    }
 
     // Sending SIGUSR1 signal to processes
 
+    trace_kill(0, SIGUSR1);
+
     if (kill(0, SIGUSR1)) {
         ERR("kill");
     }
@@ -140,11 +212,12 @@ void parent_work(int b, int s, char * name) {
 
 void usage(char * name) {
 
-    fprintf(stderr, "USAGE: %s m b s \n", name);
+    fprintf(stderr, "USAGE: %s m b s name [--auto]\n", name);
     fprintf(stderr,"m - number of 1/1000 miliseconds between signals [1, 999], i.e. one milisecond maximum\n");
     fprintf(stderr, "b - number of blocks [1, 999]\n");
     fprintf(stderr, "s - size of blocks [1, 999] in MB\n");
     fprintf(stderr, "name of the output file\n");
+    fprintf(stderr, "--auto - tune size of read/write calls inside blocks at runtime\n");
     exit(EXIT_FAILURE);
 
 }
@@ -153,6 +226,12 @@ int main(int argc, char ** argv) {
 
     int m, b, s;
     char * name;
+    int autotune = 0;
+
+    if (6 == argc && !strcmp(argv[5], "--auto")) {
+        autotune = 1;
+        argc--;
+    }
 
     if (argc != 5) {
         usage(argv[0]);
@@ -167,6 +246,10 @@ int main(int argc, char ** argv) {
         usage(argv[0]);
     }
 
+    // Binary event trace, only with TRACE set (see trace.h)
+
+    trace_init();
+
     // Setting signal handler for SIGUSR1 signal
 
     setHandler(sig_handler, SIGUSR1);
@@ -182,8 +265,13 @@ int main(int argc, char ** argv) {
     if (0 == pid) {
         child_work(m);
     } else {
-        parent_work(b, s * 1024 * 1024, name);
-        while(wait(NULL) > 0);
+        int status;
+
+        trace_fork(pid);
+        parent_work(b, s * 1024 * 1024, name, autotune);
+        while((pid = wait(&status)) > 0) {
+            trace_reap(pid, status);
+        }
     }
 
     return EXIT_SUCCESS;
@@ -8,6 +8,20 @@
 #include <string.h>
 #include <time.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/ioprio.h>
+#include <stdatomic.h>
+
+#include "autotune.h"
+#include "bufalloc.h"
+#include "pacing.h"
+#include "perfctr.h"
+#include "trace.h"
 
 #define ERR(source) (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
                     perror(source), kill(0, SIGKILL), \
@@ -17,6 +31,101 @@
 
 volatile sig_atomic_t sig_count = 0;
 
+// Vectored engine, IOVEC environment variable: "n[,dsync][,nowait]" moves n
+// blocks per preadv2 / pwritev2 instead of one block per read / write.
+// io_batch 0 is the original bulk engine. io_calls counts read and write
+// syscalls of either engine (retries included) for the syscalls-per-MB figure
+
+#define VEC_MAX_BYTES (64 * 1024 * 1024)
+
+int io_batch = 0;
+int io_read_flags = 0;
+int io_write_flags = 0;
+long long io_calls = 0;
+
+// In-kernel copy for regular file sources: copy_file_range between regular
+// files, sendfile to anything else, each falling back to the next one (and
+// finally to bulk_read / bulk_write) when the kernel or filesystem refuses
+
+#define COPY_NONE 0
+#define COPY_RANGE 1
+#define COPY_SENDFILE 2
+
+int io_copy = COPY_NONE;
+
+// Fan-out to several outputs (name is a comma-separated list). Parent reads
+// the source once into a shared ring of FAN_SLOTS chunks and one writer
+// process per output writes every chunk straight from the ring, so data
+// enters user space once whatever the number of outputs. A slot is not
+// reused until the slowest writer is done with it: a slow output holds the
+// reader back (backpressure) instead of growing a buffer. Both sides sleep
+// on futex words, like shm mode of prog15
+
+#define FAN_MAX 16
+#define FAN_SLOTS 16
+#define FAN_CHUNK (1024 * 1024)
+#define CACHE_LINE 64
+
+struct fan_writer {
+    _Atomic unsigned int consumed __attribute__((aligned(CACHE_LINE)));
+    long long calls;
+};
+
+struct fan_ring {
+    _Atomic unsigned int produced __attribute__((aligned(CACHE_LINE)));
+    struct fan_writer out[FAN_MAX];
+    size_t len[FAN_SLOTS];
+    char data[FAN_SLOTS][FAN_CHUNK] __attribute__((aligned(4096)));
+};
+
+int io_outputs = 1;
+
+// Bandwidth cap, RATE environment variable: "MB/s[,iops=N][,burst=MB]" plus
+// optional ",idle" or ",be=level" I/O priority class. Two token buckets
+// (bytes and write calls) are charged before every chunk is written and the
+// debt is slept off. Writes are split into chunks of about 1/RATE_TICKS s of
+// bandwidth, so the cap holds within a block instead of one big write per
+// block. Achieved rate against the cap is printed once a second
+
+#define RATE_TICKS 50
+#define RATE_MIN_CHUNK 4096
+#define RATE_MAX_CHUNK (4 * 1024 * 1024)
+
+struct rate_bucket {
+    double rate;
+    double burst;
+    double tokens;
+};
+
+struct rate_bucket rate_bytes, rate_ops;
+size_t rate_chunk = 0;
+long long rate_last, rate_report_start, rate_report_at;
+long long rate_start, rate_total = 0, rate_total_ops = 0, rate_period_bytes = 0, rate_period_ops = 0;
+
+// Page-cache hygiene, CACHE environment variable: window in MB. Writeback
+// of written ranges is started right away (sync_file_range), once more than
+// the window is behind the writer the oldest part is waited for and dropped
+// with POSIX_FADV_DONTNEED, so about a window of the output stays cached.
+// Consumed ranges of a regular file source are dropped the same way. Pages
+// in cache (mincore) are sampled once a second, peak at the end: all of the
+// window, dropped part only at CACHE_PROBES evenly spaced pages
+
+#define CACHE_MIN_CHUNK (64 * 1024)
+#define CACHE_PROBES 256
+
+struct cache_track {
+    int fd;
+    int on;
+    int write;
+    char name[16];
+    long long start, end, started, dropped;
+    long long peak, next_sample;
+};
+
+long long cache_window = 0;
+size_t cache_chunk = 0;
+struct cache_track cache_in, cache_out;
+
 void setHandler(void (*f)(int), int sigNo) {
 
     // This structure specifies how to handle a signal
@@ -42,14 +151,17 @@ void setHandler(void (*f)(int), int sigNo) {
 // Function handling given signal
 
 void sig_handler(int sig) {
+    trace_signal(sig);
     sig_count++;
 }
 
 void child_work(int m) {
 
-    // Structure holding an interval broken down into seconds and nanoseconds
+    // Pacer sending every m * 10 microseconds (see pacing.h, PACE variable)
+
+    struct pacer pc;
 
-    struct timespec t = {0, m * 10000};
+    pacer_init(&pc, m * 10000);
 
     // We are setting SIG_DFL default handler for SIGUSR1 signal
 
@@ -57,12 +169,14 @@ void child_work(int m) {
 
     while (1) {
 
-        // Nanosleep handles delays
+        // Pacing engine handles delays
 
-        nanosleep(&t, NULL);
+        pacer_wait(&pc);
 
         // Sending SIGUSR1 to parent and checking if everything went fine
 
+        trace_kill(getppid(), SIGUSR1);
+
         if (kill(getppid(), SIGUSR1)) {
             ERR("kill");
         }
@@ -82,7 +196,7 @@ ssize_t bulk_read (int fd, char * buf, size_t count) {
 
         // We check whether some bytes were read
 
-        c = TEMP_FAILURE_RETRY(read(fd, buf, count));
+        c = PC_RETRY((io_calls++, read(fd, buf, count)));
 
         // If there is an error in macro...
 
@@ -96,6 +210,8 @@ ssize_t bulk_read (int fd, char * buf, size_t count) {
             return len;
         }
 
+        PC_SHORT((size_t) c, count);
+
         // We're counting how much information we've processed
 
         buf += c;
@@ -111,7 +227,7 @@ ssize_t bulk_read (int fd, char * buf, size_t count) {
 
 ssize_t bulk_write(int fd, char * buf, size_t count) {
 
-    size_t c;
+    ssize_t c;
     ssize_t len = 0;
 
     // We are using this macro to retry the operation in a loop until we're done
@@ -120,7 +236,7 @@ ssize_t bulk_write(int fd, char * buf, size_t count) {
 
         // We check whether some bytes were written
 
-        c = TEMP_FAILURE_RETRY(write(fd, buf, count));
+        c = PC_RETRY((io_calls++, write(fd, buf, count)));
         
         // Checking if there wasn't any error
 
@@ -128,6 +244,8 @@ ssize_t bulk_write(int fd, char * buf, size_t count) {
             return c;
         }
 
+        PC_SHORT((size_t) c, count);
+
         buf += c;
         len += c;
         count -= c;
@@ -137,69 +255,1014 @@ ssize_t bulk_write(int fd, char * buf, size_t count) {
     return len;
 }
 
-void parent_work(int b, int s, char * name) {
+// Skips done bytes of an iovec array: fully transferred entries are dropped,
+// a partially transferred one is trimmed, so the next call resumes exactly
+// where the short one stopped
 
-    int i, in, out;
-    ssize_t count;
-    char * buf = malloc(s);
+void iov_advance(struct iovec ** iov, int * cnt, size_t done) {
 
-    // Checking malloc correctness
+    while (*cnt > 0 && done >= (*iov)->iov_len) {
+        done -= (*iov)->iov_len;
+        (*iov)++;
+        (*cnt)--;
+    }
 
-    if (!buf) {
-        ERR("malloc");
+    if (*cnt > 0) {
+        (*iov)->iov_base = (char *) (*iov)->iov_base + done;
+        (*iov)->iov_len -= done;
     }
+}
 
-    // Opens file "name" for write only, if not existent creates it, truncates the
-    // length to 0 and the file offset shall be set to the end of the file prior
-    // to each write, octal mode and checks if it was correct
+// Vectored counterpart of bulk_read / bulk_write. RWF_NOWAIT is a hint: on
+// EAGAIN the call is repeated blocking, on EOPNOTSUPP (file doesn't support
+// it) the flag is dropped for good
 
-    if ((out = open(name, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0777)) < 0) {
-        ERR("open");
+ssize_t bulk_vec(int fd, struct iovec * iov, int cnt, int write_op) {
+
+    ssize_t c;
+    ssize_t len = 0;
+    size_t want = 0;
+    int * flags = write_op ? &io_write_flags : &io_read_flags;
+    int nowait = 0;
+
+    for (int i = 0; i < cnt; i++) {
+        want += iov[i].iov_len;
     }
 
-    // Opens /dev/urandom location as read only and checks if it worked
+    do {
 
-    if ((in = open("/dev/urandom", O_RDONLY)) < 0) {
-        ERR("open");
+        int f = nowait ? *flags & ~RWF_NOWAIT : *flags;
+
+        if (write_op) {
+            c = PC_RETRY((io_calls++, pwritev2(fd, iov, cnt, -1, f)));
+        } else {
+            c = PC_RETRY((io_calls++, preadv2(fd, iov, cnt, -1, f)));
+        }
+
+        if (c < 0 && (f & RWF_NOWAIT) && (EAGAIN == errno || EOPNOTSUPP == errno)) {
+            if (EOPNOTSUPP == errno) {
+                *flags &= ~RWF_NOWAIT;
+            }
+            nowait = 1;
+            continue;
+        }
+
+        nowait = 0;
+
+        if (c < 0) {
+            return c;
+        }
+
+        // EOF on read
+
+        if (c == 0) {
+            return len;
+        }
+
+        PC_SHORT((size_t) c, want);
+
+        len += c;
+        want -= c;
+        iov_advance(&iov, &cnt, c);
+
+    } while (cnt > 0);
+
+    return len;
+}
+
+// Errors meaning "this fd pair can't do it", not a failed transfer
+
+int copy_unsupported(int err) {
+    return EXDEV == err || EINVAL == err || EOPNOTSUPP == err || ENOSYS == err;
+}
+
+// Moves count bytes from in to out inside the kernel, returns bytes moved
+// (less only on EOF). After a fallback the rest goes through buf
+
+ssize_t bulk_copy(int in, int out, char * buf, size_t count) {
+
+    ssize_t c;
+    ssize_t len = 0;
+
+    while (count > 0 && io_copy != COPY_NONE) {
+
+        if (COPY_RANGE == io_copy) {
+            c = PC_RETRY((io_calls++, copy_file_range(in, NULL, out, NULL, count, 0)));
+        } else {
+            c = PC_RETRY((io_calls++, sendfile(out, in, NULL, count)));
+        }
+
+        if (c < 0 && copy_unsupported(errno)) {
+            io_copy = COPY_RANGE == io_copy ? COPY_SENDFILE : COPY_NONE;
+            continue;
+        }
+
+        if (c <= 0) {
+            return c < 0 ? c : len;
+        }
+
+        PC_SHORT((size_t) c, count);
+
+        len += c;
+        count -= c;
+    }
+
+    if (count > 0) {
+
+        if ((c = bulk_read(in, buf, count)) < 0 || (c = bulk_write(out, buf, c)) < 0) {
+            return c;
+        }
+
+        len += c;
+    }
+
+    return len;
+}
+
+// Picks in-kernel copy when the source is a regular file, it supersedes the
+// vectored engine. Both calls refuse
+// O_APPEND output; out was just truncated and has one writer, so dropping
+// the flag writes exactly the same bytes
+
+void copy_setup(int in, int out) {
+
+    struct stat sin, sout;
+
+    if (fstat(in, &sin) < 0 || fstat(out, &sout) < 0) {
+        ERR("fstat");
+    }
+
+    if (!S_ISREG(sin.st_mode)) {
+        return;
+    }
+
+    io_copy = S_ISREG(sout.st_mode) ? COPY_RANGE : COPY_SENDFILE;
+    io_batch = 0;
+
+    if (fcntl(out, F_SETFL, fcntl(out, F_GETFL) & ~O_APPEND) < 0) {
+        ERR("fcntl");
+    }
+}
+
+const char * io_engine(void) {
+    switch (io_copy) {
+        case COPY_RANGE:
+            return "copy_file_range";
+        case COPY_SENDFILE:
+            return "sendfile";
+        default:
+            if (io_outputs > 1) {
+                return "fan";
+            }
+            return io_batch ? "vec" : "bulk";
+    }
+}
+
+// Points iov at consecutive blocks of the ring covering count bytes, returns
+// number of entries used
+
+int iov_fill(struct iovec * iov, char * buf, int s, int n, ssize_t count) {
+
+    int k;
+
+    for (k = 0; k < n && count > 0; k++) {
+        iov[k].iov_base = buf + (size_t) k * s;
+        iov[k].iov_len = count < s ? count : s;
+        count -= iov[k].iov_len;
+    }
+
+    return k;
+}
+
+// Reads IOVEC, batch is capped so the ring stays within VEC_MAX_BYTES
+
+void io_setup(int s) {
+
+    char * env = getenv("IOVEC");
+
+    if (!env) {
+        return;
+    }
+
+    io_batch = atoi(env);
+
+    if (io_batch <= 0) {
+        io_batch = 1;
+    }
+
+    if (io_batch > IOV_MAX) {
+        io_batch = IOV_MAX;
+    }
+
+    if (io_batch > 1 && (long long) io_batch * s > VEC_MAX_BYTES) {
+        io_batch = VEC_MAX_BYTES / s > 1 ? VEC_MAX_BYTES / s : 1;
+    }
+
+    if (strstr(env, "dsync")) {
+        io_write_flags |= RWF_DSYNC;
+    }
+
+    if (strstr(env, "nowait")) {
+        io_read_flags |= RWF_NOWAIT;
+        io_write_flags |= RWF_NOWAIT;
+    }
+}
+
+// Syscalls per MB moved, on stderr with the vectored engine and always in
+// BENCH_METRICS for the benchmark driver
+
+void io_report(long long bytes) {
+
+    char * path = getenv("BENCH_METRICS");
+    double mb = bytes / (1024.0 * 1024.0);
+    FILE * f;
+
+    if (io_batch || io_copy || io_outputs > 1) {
+        fprintf(stderr, "[io] %s batch %d: %lld syscalls, %.0f MB, %.3f syscalls/MB\n",
+                io_engine(), io_batch ? io_batch : 1, io_calls, mb, mb > 0 ? io_calls / mb : 0.0);
+    }
+
+    if (!path || !(f = fopen(path, "a"))) {
+        return;
+    }
+
+    fprintf(f, "io_batch %d\nsyscalls %lld\nsyscalls_per_mb %.3f\n", io_batch ? io_batch : 1, io_calls,
+            mb > 0 ? io_calls / mb : 0.0);
+    fclose(f);
+}
+
+void rate_setup(void) {
+
+    char * env = getenv("RATE");
+    char * p;
+    int ioprio = -1;
+
+    if (!env) {
+        return;
+    }
+
+    // No byte cap (0) leaves only the IOPS one
+
+    rate_bytes.rate = atof(env) * 1024 * 1024;
+    rate_bytes.burst = rate_bytes.rate / RATE_TICKS;
+
+    if ((p = strstr(env, "burst="))) {
+        rate_bytes.burst = atof(p + 6) * 1024 * 1024;
+    }
+
+    if ((p = strstr(env, "iops="))) {
+        rate_ops.rate = atof(p + 5);
+        rate_ops.burst = rate_ops.rate / RATE_TICKS > 1 ? rate_ops.rate / RATE_TICKS : 1;
+    }
+
+    rate_bytes.tokens = rate_bytes.burst;
+    rate_ops.tokens = rate_ops.burst;
+
+    rate_chunk = rate_bytes.rate ? rate_bytes.rate / RATE_TICKS : RATE_MAX_CHUNK;
+
+    if (rate_chunk > RATE_MAX_CHUNK) {
+        rate_chunk = RATE_MAX_CHUNK;
+    }
+
+    if (rate_chunk < RATE_MIN_CHUNK) {
+        rate_chunk = RATE_MIN_CHUNK;
+    }
+
+    // Optional I/O scheduling class, inherited by fan-out writers
+
+    if (strstr(env, "idle")) {
+        ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+    } else if ((p = strstr(env, "be="))) {
+        ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, atoi(p + 3));
+    }
+
+    if (ioprio >= 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) < 0) {
+        ERR("ioprio_set");
+    }
+
+    // Batching would defeat chunking, RATE wins over IOVEC
+
+    io_batch = 0;
+    rate_start = rate_last = rate_report_start = pace_now();
+    rate_report_at = rate_start + PACE_REPORT_NS;
+}
+
+// Adds tokens for dt, charges n and returns how long to sleep off the debt
+
+long long rate_charge(struct rate_bucket * b, long long dt, double n) {
+
+    if (!b->rate) {
+        return 0;
+    }
+
+    b->tokens += b->rate * dt / 1e9;
+
+    if (b->tokens > b->burst) {
+        b->tokens = b->burst;
+    }
+
+    b->tokens -= n;
+
+    return b->tokens < 0 ? -b->tokens / b->rate * 1e9 : 0;
+}
+
+void rate_print(const char * what, long long bytes, long long ops, long long ns) {
+
+    double sec = ns / 1e9;
+
+    fprintf(stderr, "[rate] %s %.2f s: %.2f MB/s", what, sec, bytes / sec / (1024 * 1024));
+
+    if (rate_bytes.rate) {
+        fprintf(stderr, " (cap %.2f)", rate_bytes.rate / (1024 * 1024));
+    }
+
+    fprintf(stderr, ", %.1f IOPS", ops / sec);
+
+    if (rate_ops.rate) {
+        fprintf(stderr, " (cap %.1f)", rate_ops.rate);
+    }
+
+    fprintf(stderr, "\n");
+}
+
+// Waits until len bytes in one write call fit under the caps
+
+void rate_take(size_t len) {
+
+    long long now = pace_now();
+    long long dt = now - rate_last;
+    long long wait = rate_charge(&rate_bytes, dt, len);
+    long long wait_ops = rate_charge(&rate_ops, dt, 1);
+    long long deadline = now + (wait > wait_ops ? wait : wait_ops);
+
+    rate_last = now;
+
+    // Absolute deadline, signals only make it loop
+
+    while ((now = pace_now()) < deadline) {
+        pace_sleep_until(deadline);
+    }
+
+    rate_total += len;
+    rate_total_ops++;
+    rate_period_bytes += len;
+    rate_period_ops++;
+
+    if (now >= rate_report_at) {
+        rate_print("last", rate_period_bytes, rate_period_ops, now - rate_report_start);
+        rate_period_bytes = rate_period_ops = 0;
+        rate_report_start = now;
+        rate_report_at = now + PACE_REPORT_NS;
+    }
+}
+
+void cache_open(struct cache_track * t, int fd, int write, const char * name) {
+
+    struct stat st;
+
+    memset(t, 0, sizeof(struct cache_track));
+    t->fd = fd;
+    t->write = write;
+    snprintf(t->name, sizeof(t->name), "%s", name);
+
+    if (!cache_window || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+
+    t->on = 1;
+    t->start = t->end = t->started = t->dropped = lseek(fd, 0, SEEK_CUR) > 0 ? lseek(fd, 0, SEEK_CUR) : 0;
+    t->next_sample = pace_now() + PACE_REPORT_NS;
+}
+
+void cache_setup(int in, int out) {
+
+    char * env = getenv("CACHE");
+
+    if (!env) {
+        return;
+    }
+
+    cache_window = atoll(env) * 1024 * 1024;
+
+    if (cache_window < 4 * CACHE_MIN_CHUNK) {
+        cache_window = 4 * CACHE_MIN_CHUNK;
+    }
+
+    // Chunks of a quarter window keep the window sliding inside big blocks
+
+    cache_chunk = cache_window / 4;
+    cache_open(&cache_in, in, 0, "source");
+    cache_open(&cache_out, out, 1, "output");
+}
+
+// Bytes of the tracked range in page cache, read through a second read-only
+// descriptor since output is write-only. Cost is bounded by the window, not
+// by the file: what was dropped is only probed and scaled up
+
+long long cache_resident(struct cache_track * t) {
+
+    char path[64];
+    struct stat st;
+    long page = sysconf(_SC_PAGESIZE);
+    long long lo = t->start / page * page, mid, hi = t->end, pages = 0, probes = 0, hits = 0, n;
+    unsigned char * vec, c;
+    char * p;
+    int rfd;
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", t->fd);
+
+    if ((rfd = open(path, O_RDONLY)) < 0) {
+        return -1;
+    }
+
+    if (fstat(rfd, &st) < 0 || (hi = hi < st.st_size ? hi : st.st_size) <= lo) {
+        close(rfd);
+        return 0;
+    }
+
+    p = mmap(NULL, hi - lo, PROT_READ, MAP_SHARED, rfd, lo);
+    close(rfd);
+
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+
+    // Window [dropped, end) page by page
+
+    mid = t->dropped / page * page > lo ? t->dropped / page * page : lo;
+    mid = mid < hi ? mid : hi;
+    n = (hi - mid + page - 1) / page;
+
+    if (n && (vec = malloc(n))) {
+
+        if (!mincore(p + (mid - lo), hi - mid, vec)) {
+            for (long long i = 0; i < n; i++) {
+                pages += vec[i] & 1;
+            }
+        }
+
+        free(vec);
+    }
+
+    // Dropped part [start, dropped) by probes
+
+    n = (mid - lo) / page;
+
+    for (long long i = 0; i < n; i += n > CACHE_PROBES ? n / CACHE_PROBES : 1) {
+        if (!mincore(p + i * page, page, &c)) {
+            hits += c & 1;
+            probes++;
+        }
+    }
+
+    munmap(p, hi - lo);
+
+    return (pages + (probes ? hits * n / probes : 0)) * page;
+}
+
+void cache_sample(struct cache_track * t, int last) {
+
+    long long now = pace_now();
+    long long resident;
+
+    if (!last && now < t->next_sample) {
+        return;
+    }
+
+    t->next_sample = now + PACE_REPORT_NS;
+
+    if ((resident = cache_resident(t)) > t->peak) {
+        t->peak = resident;
+    }
+
+    fprintf(stderr, "[cache] %s %.1f MB cached, peak %.1f MB, window %lld MB, %.1f MB done\n", t->name,
+            resident / 1048576.0, t->peak / 1048576.0, cache_window >> 20, (t->end - t->start) / 1048576.0);
+}
+
+// Flushes (output) and drops [dropped, upto)
+
+void cache_drop(struct cache_track * t, long long upto) {
+
+    int err;
+
+    if (upto <= t->dropped) {
+        return;
+    }
+
+    if (t->write && TEMP_FAILURE_RETRY(sync_file_range(t->fd, t->dropped, upto - t->dropped,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER)) < 0) {
+        ERR("sync_file_range");
     }
 
-    // b == amount of blocks of set size
+    if ((err = posix_fadvise(t->fd, t->dropped, upto - t->dropped, POSIX_FADV_DONTNEED))) {
+        errno = err;
+        ERR("posix_fadvise");
+    }
+
+    t->dropped = upto;
+}
+
+// Accounts len more bytes written to / consumed from the file
+
+void cache_advance(struct cache_track * t, long long len) {
+
+    if (!t->on || len <= 0) {
+        return;
+    }
+
+    t->end += len;
+
+    // Writeback starts now, not when the dirty limits say so
+
+    if (t->write && TEMP_FAILURE_RETRY(sync_file_range(t->fd, t->started, t->end - t->started,
+                                                       SYNC_FILE_RANGE_WRITE)) < 0) {
+        ERR("sync_file_range");
+    }
+
+    t->started = t->end;
+
+    if (t->end - t->dropped > cache_window) {
+        cache_drop(t, t->end - cache_window);
+    }
+
+    cache_sample(t, 0);
+}
+
+void cache_finish(struct cache_track * t) {
+
+    if (!t->on) {
+        return;
+    }
+
+    cache_drop(t, t->end);
+    cache_sample(t, 1);
+}
+
+// Write half of one block, in rate-limited (RATE) or window-sized (CACHE)
+// chunks. Returns bytes written, less than count only on EOF of in-kernel
+// copy source. Copy mode is taken once per block: after a fallback inside
+// bulk_copy the rest of the block still has to be read through buf
+
+ssize_t block_write(int in, int out, char * buf, size_t count) {
+
+    int copy = io_copy;
+    ssize_t c;
+    ssize_t len = 0;
+    size_t n;
+
+    while (count > 0) {
+
+        n = rate_chunk && count > rate_chunk ? rate_chunk : count;
+
+        if (cache_chunk && n > cache_chunk) {
+            n = cache_chunk;
+        }
+
+        if (rate_chunk) {
+            rate_take(n);
+        }
+
+        if ((c = copy ? bulk_copy(in, out, buf, n) : bulk_write(out, buf, n)) < 0) {
+            return c;
+        }
+
+        if (copy) {
+            cache_advance(&cache_in, c);
+        }
+
+        cache_advance(&cache_out, c);
+        len += c;
+
+        if ((size_t) c < n) {
+            break;
+        }
+
+        buf += c;
+        count -= c;
+    }
+
+    return len;
+}
+
+int futex(_Atomic unsigned int * uaddr, int op, unsigned int val, const struct timespec * timeout) {
+    return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+// Sleeps while word still holds val, spurious and signal wake-ups are fine,
+// callers re-check
+
+void futex_wait(_Atomic unsigned int * word, unsigned int val) {
+    if (futex(word, FUTEX_WAIT, val, NULL) < 0 && EAGAIN != errno && EINTR != errno) {
+        ERR("futex");
+    }
+}
+
+// Writer k: every published chunk goes to fd, empty chunk ends the stream
+
+void fan_writer_work(struct fan_ring * r, int k, int fd) {
+
+    unsigned int seq = 0;
+    size_t len;
+    char name[16];
+
+    io_calls = 0;
+    snprintf(name, sizeof(name), "output %d", k);
+    cache_open(&cache_out, fd, 1, name);
+
+    while (1) {
+
+        while (atomic_load(&r->produced) == seq) {
+            futex_wait(&r->produced, seq);
+        }
+
+        if (!(len = r->len[seq % FAN_SLOTS])) {
+            break;
+        }
+
+        if (bulk_write(fd, r->data[seq % FAN_SLOTS], len) < 0) {
+            ERR("write");
+        }
+
+        cache_advance(&cache_out, len);
+        atomic_store(&r->out[k].consumed, ++seq);
+
+        if (futex(&r->out[k].consumed, FUTEX_WAKE, 1, NULL) < 0) {
+            ERR("futex");
+        }
+    }
+
+    cache_finish(&cache_out);
+    r->out[k].calls = io_calls;
+    exit(EXIT_SUCCESS);
+}
+
+// Waits until no writer still needs the slot of chunk seq, returns 1 if the
+// reader had to stall
+
+int fan_reserve(struct fan_ring * r, int nout, unsigned int seq) {
+
+    unsigned int c;
+    int stalled = 0;
+
+    for (int k = 0; k < nout; k++) {
+        while (seq - (c = atomic_load(&r->out[k].consumed)) >= FAN_SLOTS) {
+            stalled = 1;
+            futex_wait(&r->out[k].consumed, c);
+        }
+    }
+
+    return stalled;
+}
+
+void fan_publish(struct fan_ring * r, unsigned int seq, size_t len) {
+
+    r->len[seq % FAN_SLOTS] = len;
+    atomic_store(&r->produced, seq + 1);
+
+    if (futex(&r->produced, FUTEX_WAKE, INT_MAX, NULL) < 0) {
+        ERR("futex");
+    }
+}
+
+// Block loop of fan-out mode, returns bytes read. A block is reported once
+// it is in the ring, writers are at most FAN_SLOTS chunks behind
+
+long long fan_out(int in, int * outs, int nout, int b, int s) {
+
+    struct fan_ring * r;
+    pid_t pids[FAN_MAX];
+    unsigned int seq = 0;
+    long long total = 0, stalls = 0;
+    ssize_t count, c = 0;
+    size_t want;
+    int i, k, status;
+
+    r = mmap(NULL, sizeof(struct fan_ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (r == MAP_FAILED) {
+        ERR("mmap");
+    }
+
+    for (k = 0; k < nout; k++) {
+
+        if ((pids[k] = fork()) < 0) {
+            ERR("fork");
+        }
+
+        if (0 == pids[k]) {
+            fan_writer_work(r, k, outs[k]);
+        }
+
+        trace_fork(pids[k]);
+    }
 
     for (i = 0; i < b; i++) {
 
-        // Function reads s bytes from input and puts them in buffer
+        trace_io_begin(i, s);
+
+        // Block goes to the ring chunk by chunk
+
+        for (count = 0; count < s; count += c) {
+
+            want = s - count < FAN_CHUNK ? s - count : FAN_CHUNK;
+
+            if (rate_chunk && want > rate_chunk) {
+                want = rate_chunk;
+            }
+
+            stalls += fan_reserve(r, nout, seq);
+
+            if ((c = bulk_read(in, r->data[seq % FAN_SLOTS], want)) < 0) {
+                ERR("read");
+            }
+
+            if (!c) {
+                break;
+            }
+
+            cache_advance(&cache_in, c);
+
+            if (rate_chunk) {
+                rate_take(c);
+            }
+
+            fan_publish(r, seq++, c);
+        }
+
+        trace_io_end(i, count);
+        total += count;
+
+        if (count && TEMP_FAILURE_RETRY(fprintf(stderr, "Blocks %ld bytes transferred. Signals RX:%d\n", count, sig_count) < 0)) {
+            ERR("fprintf");
+        }
+
+        if (count < s) {
+            break;
+        }
+    }
+
+    // End of stream, then writers' syscalls are added to the parent's
+
+    fan_reserve(r, nout, seq);
+    fan_publish(r, seq, 0);
+
+    for (k = 0; k < nout; k++) {
+
+        if (TEMP_FAILURE_RETRY(waitpid(pids[k], &status, 0)) < 0) {
+            ERR("waitpid");
+        }
+
+        trace_reap(pids[k], status);
+        io_calls += r->out[k].calls;
+    }
+
+    fprintf(stderr, "[io] fan %d outputs: reader stalled %lld times on the slowest one\n", nout, stalls);
+
+    if (munmap(r, sizeof(struct fan_ring))) {
+        ERR("munmap");
+    }
+
+    return total;
+}
+
+// Chunk size tuner (--auto, see autotune.h), on only for the bulk and
+// in-kernel copy engines of a single output without RATE
+
+struct autotune tune;
+
+// Both halves of one block in tuned chunks, returns bytes written
+
+ssize_t block_auto(int in, int out, char * buf, size_t count) {
+
+    ssize_t c;
+    ssize_t len = 0;
+    size_t n;
+    long long start;
+
+    while (count > 0) {
+
+        n = count < at_chunk(&tune) ? count : at_chunk(&tune);
+        start = at_now();
+
+        if (io_copy) {
+            c = bulk_copy(in, out, buf, n);
+        } else if ((c = bulk_read(in, buf, n)) > 0) {
+            c = bulk_write(out, buf, c);
+        }
+
+        if (c < 0) {
+            return c;
+        }
+
+        at_record(&tune, c, at_now() - start);
+        cache_advance(&cache_in, c);
+        cache_advance(&cache_out, c);
+        len += c;
+
+        if ((size_t) c < n) {
+            break;
+        }
+
+        count -= c;
+    }
+
+    return len;
+}
+
+// Block loop of single output, returns bytes written
+
+long long copy_blocks(int in, int out, int b, int s) {
+
+    int i, j;
+    ssize_t count, left;
+    long long total = 0;
+
+    // Ring of n blocks, one block for the bulk engine
+
+    int n = io_batch ? io_batch : 1;
+    struct iovec iov[n];
+    char * buf = buf_get((size_t) n * s);
+
+    // Checking malloc correctness (huge page buffer with HUGEBUF, bufalloc.h)
+
+    if (!buf) {
+        ERR("malloc");
+    }
+
+    // Hot-path counters, only in builds with -DPERFCTR (see perfctr.h)
+
+    PC_INIT();
+    buf_loop_begin();
+
+    // b == amount of blocks of set size, n of them per iteration
+
+    for (i = 0; i < b; i += n) {
+
+        if (n > b - i) {
+            n = b - i;
+        }
+
+        long long block_ns = buf_block_begin();
 
-        if ((count = bulk_read(in, buf, s)) < 0) {
+        PC_SAMPLE(block_start);
+        trace_io_begin(i, (int64_t) n * s);
+
+        // Function reads s bytes (n blocks of them) from input and puts them in
+        // buffer, in-kernel copy and tuned chunks do both halves in one step below
+
+        if (io_copy || tune.on) {
+            count = s;
+        } else if (io_batch) {
+            count = bulk_vec(in, iov, iov_fill(iov, buf, s, n, (ssize_t) n * s), 0);
+        } else {
+            count = bulk_read(in, buf, s);
+        }
+
+        if (count < 0) {
             ERR("read");
         }
 
-        // Writes count bytes from buffer to out
+        if (!io_copy && !tune.on) {
+            cache_advance(&cache_in, count);
+        }
+
+        PC_SAMPLE(read_end);
 
-        if ((count = bulk_write(out, buf, count)) < 0) {
+        // Writes count bytes from buffer to out (or copies the block in kernel)
+
+        if (io_batch) {
+            count = bulk_vec(out, iov, iov_fill(iov, buf, s, n, count), 1);
+            cache_advance(&cache_out, count);
+        } else if (tune.on) {
+            count = block_auto(in, out, buf, count);
+        } else {
+            count = block_write(in, out, buf, count);
+        }
+
+        if (count < 0) {
             ERR("write");
         }
 
-        // Informing about operation by stderr
+        trace_io_end(i, count);
+        PC_SAMPLE(write_end);
+        PC_ADD(PC_READ_CALL, block_start, read_end);
+        PC_ADD(PC_WRITE_CALL, read_end, write_end);
+        total += count;
 
-        if (TEMP_FAILURE_RETRY(fprintf(stderr, "Blocks %ld bytes transferred. Signals RX:%d\n", count, sig_count) < 0)) {
-            ERR("fprintf");
+        // Informing about operation by stderr, block by block
+
+        for (j = 0, left = count; j < n && left > 0; j++, left -= s) {
+            if (TEMP_FAILURE_RETRY(fprintf(stderr, "Blocks %ld bytes transferred. Signals RX:%d\n",
+                                           left < s ? left : s, sig_count) < 0)) {
+                ERR("fprintf");
+            }
+        }
+
+        buf_block(block_ns);
+        PC_SAMPLE(block_end);
+        PC_ADD(PC_BLOCK, block_start, block_end);
+        PC_BLOCK_REPORT(i);
+
+        // Source ended (never for /dev/urandom)
+
+        if (count < (ssize_t) n * s) {
+            break;
         }
     }
 
-    // Closing files, freeing memory
+    PC_REPORT();
+    buf_report();
+    buf_free(buf);
 
-    if (TEMP_FAILURE_RETRY(close(in))) {
-        ERR("close");
+    return total;
+}
+
+void parent_work(int b, int s, char * name, char * source, int autotune) {
+
+    int in, outs[FAN_MAX];
+    char * next;
+    long long total;
+
+    // Opens every file in "name" for write only, if not existent creates it,
+    // truncates the length to 0 and the file offset shall be set to the end of
+    // the file prior to each write, octal mode and checks if it was correct
+
+    for (io_outputs = 0; name; name = next) {
+
+        if ((next = strchr(name, ','))) {
+            *next++ = '\0';
+        }
+
+        if (io_outputs == FAN_MAX) {
+            fprintf(stderr, "at most %d outputs\n", FAN_MAX);
+            exit(EXIT_FAILURE);
+        }
+
+        if ((outs[io_outputs++] = TEMP_FAILURE_RETRY(open(name, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0777))) < 0) {
+            ERR("open");
+        }
     }
 
-    if (TEMP_FAILURE_RETRY(close(out))) {
+    // Opens source (/dev/urandom by default, "-" or fd:N for an inherited
+    // descriptor) as read only and checks if it worked
+
+    if (!strcmp(source, "-")) {
+        in = STDIN_FILENO;
+    } else if (!strncmp(source, "fd:", 3)) {
+        in = atoi(source + 3);
+    } else if ((in = open(source, O_RDONLY)) < 0) {
+        ERR("open");
+    }
+
+    // Output track only for a single output, fan-out writers keep their own
+
+    cache_setup(in, io_outputs > 1 ? -1 : outs[0]);
+
+    if (io_outputs > 1) {
+        rate_setup();
+        total = fan_out(in, outs, io_outputs, b, s);
+    } else {
+        io_setup(s);
+        copy_setup(in, outs[0]);
+        rate_setup();
+
+        if (autotune && !rate_chunk) {
+            at_init(&tune, s, outs[0]);
+            io_batch = 0;
+        }
+
+        total = copy_blocks(in, outs[0], b, s);
+    }
+
+    if (tune.on) {
+        at_finish(&tune);
+    }
+
+    cache_finish(&cache_in);
+    cache_finish(&cache_out);
+
+    if (rate_chunk) {
+        rate_print("total", rate_total, rate_total_ops, pace_now() - rate_start);
+    }
+
+    io_report(total);
+
+    // Closing files
+
+    if (in != STDIN_FILENO && strncmp(source, "fd:", 3) && TEMP_FAILURE_RETRY(close(in))) {
         ERR("close");
     }
 
-    free(buf);
+    for (int k = 0; k < io_outputs; k++) {
+        if (TEMP_FAILURE_RETRY(close(outs[k]))) {
+            ERR("close");
+        }
+    }
 
     // Sending SIGUSR1 signal to processes
 
+    trace_kill(0, SIGUSR1);
+
     if (kill(0, SIGUSR1)) {
         ERR("kill");
     }
@@ -209,11 +1272,13 @@ void parent_work(int b, int s, char * name) {
 
 void usage(char * name) {
 
-    fprintf(stderr, "USAGE: %s m b s \n", name);
+    fprintf(stderr, "USAGE: %s m b s name [source] [--auto]\n", name);
     fprintf(stderr,"m - number of 1/1000 miliseconds between signals [1, 999], i.e. one milisecond maximum\n");
     fprintf(stderr, "b - number of blocks [1, 999]\n");
     fprintf(stderr, "s - size of blocks [1, 999] in MB\n");
-    fprintf(stderr, "name of the output file\n");
+    fprintf(stderr, "name of the output file, comma-separated list writes the same data to each\n");
+    fprintf(stderr, "source - file to copy from (default /dev/urandom), \"-\" is stdin, fd:N an open descriptor\n");
+    fprintf(stderr, "--auto - tune size of read/write calls inside blocks at runtime\n");
     exit(EXIT_FAILURE);
 
 }
@@ -222,8 +1287,15 @@ int main(int argc, char ** argv) {
 
     int m, b, s;
     char * name;
+    char * source = "/dev/urandom";
+    int autotune = 0;
+
+    if (argc > 5 && !strcmp(argv[argc - 1], "--auto")) {
+        autotune = 1;
+        argc--;
+    }
 
-    if (argc != 5) {
+    if (argc != 5 && argc != 6) {
         usage(argv[0]);
     }
 
@@ -232,10 +1304,18 @@ int main(int argc, char ** argv) {
     s = atoi(argv[3]);
     name = argv[4];
 
+    if (6 == argc) {
+        source = argv[5];
+    }
+
     if (m <= 0 || m > 999 || b <= 0 || b > 999 || s <= 0 || s > 999) {
         usage(argv[0]);
     }
 
+    // Binary event trace, only with TRACE set (see trace.h)
+
+    trace_init();
+
     // Setting signal handler for SIGUSR1 signal
 
     setHandler(sig_handler, SIGUSR1);
@@ -251,8 +1331,13 @@ int main(int argc, char ** argv) {
     if (0 == pid) {
         child_work(m);
     } else {
-        parent_work(b, s * 1024 * 1024, name);
-        while(wait(NULL) > 0);
+        int status;
+
+        trace_fork(pid);
+        parent_work(b, s * 1024 * 1024, name, source, autotune);
+        while((pid = wait(&status)) > 0) {
+            trace_reap(pid, status);
+        }
     }
 
     return EXIT_SUCCESS;
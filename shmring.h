@@ -0,0 +1,382 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+// Single-producer single-consumer ring in shared memory, one per child, so
+// a child can hand the parent real records (pid, sequence, payload) instead
+// of a bare signal. Producer's head and consumer's tail live on separate
+// cache lines, each next to the side's cached copy of the other index, so
+// in steady state a push or a batch pop touches no line the other side
+// writes. Nobody sleeps while there is work: the consumer announces idle
+// before blocking in epoll on the rings' eventfds and only then a push costs
+// a write to the eventfd; a producer finding the ring full sleeps on a futex
+// the consumer wakes after freeing space. Both handshakes are store, full
+// fence, load of the other flag, so a wake-up can't be missed.
+//
+// Rings are created before fork (MAP_SHARED | MAP_ANONYMOUS). A producer
+// that dies before ring_close would leave the consumer asleep for good, so
+// the consumer can watch it with ring_watch (pidfd): once it is gone its
+// ring counts as closed and is finished after the records it did publish.
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <linux/futex.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#define RING_LINE 64
+#define RING_PAYLOAD 48
+#define RING_BATCH 256
+
+struct ring_rec {
+    int32_t pid;
+    uint32_t len;
+    uint64_t seq;
+    char payload[RING_PAYLOAD];
+};
+
+struct ring {
+
+    // Producer's line
+
+    _Atomic uint64_t head __attribute__((aligned(RING_LINE)));
+    uint64_t tail_cache;
+
+    // Consumer's line
+
+    _Atomic uint64_t tail __attribute__((aligned(RING_LINE)));
+    uint64_t head_cache;
+
+    // Handshake flags and setup, written rarely
+
+    _Atomic uint32_t consumer_idle __attribute__((aligned(RING_LINE)));
+    _Atomic uint32_t producer_waiting;
+    _Atomic uint32_t closed;
+    int efd;
+    uint64_t mask;
+
+    // Consumer's pidfd of the producer, -1 when not watched
+
+    int producer_fd;
+
+    struct ring_rec recs[] __attribute__((aligned(RING_LINE)));
+};
+
+static inline size_t ring_size(uint64_t capacity) {
+    return sizeof(struct ring) + capacity * sizeof(struct ring_rec);
+}
+
+// Capacity is rounded up to a power of two. Returns NULL on failure
+
+static inline struct ring * ring_create(uint64_t capacity) {
+
+    uint64_t cap;
+    struct ring * r;
+
+    for (cap = 1; cap < capacity; cap <<= 1);
+
+    r = mmap(NULL, ring_size(cap), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (r == MAP_FAILED) {
+        return NULL;
+    }
+
+    if ((r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        munmap(r, ring_size(cap));
+        return NULL;
+    }
+
+    r->mask = cap - 1;
+    r->producer_fd = -1;
+    return r;
+}
+
+static inline void ring_destroy(struct ring * r) {
+
+    if (r->producer_fd >= 0) {
+        close(r->producer_fd);
+    }
+
+    close(r->efd);
+    munmap(r, ring_size(r->mask + 1));
+}
+
+// Consumer side, after fork: ring closes by itself when producer pid exits.
+// Producer that is already gone and reaped (ESRCH) closes it right away
+
+static inline int ring_watch(struct ring * r, pid_t pid) {
+
+    if ((r->producer_fd = syscall(SYS_pidfd_open, pid, 0)) >= 0) {
+        return 0;
+    }
+
+    if (ESRCH == errno) {
+        atomic_store(&r->closed, 1);
+        return 0;
+    }
+
+    return -1;
+}
+
+static inline long ring_futex(_Atomic uint32_t * word, int op, uint32_t val) {
+    return syscall(SYS_futex, word, op, val, NULL, NULL, 0);
+}
+
+// Producer side
+
+static inline void ring_wake_consumer(struct ring * r) {
+
+    uint64_t one = 1;
+
+    if (atomic_exchange(&r->consumer_idle, 0) && write(r->efd, &one, sizeof(one)) < 0 && EAGAIN != errno) {
+        perror("ring eventfd");
+    }
+}
+
+// Waits until at least n slots are free
+
+static inline void ring_reserve(struct ring * r, uint64_t h, uint64_t n) {
+
+    while (h + n - r->tail_cache > r->mask + 1) {
+
+        r->tail_cache = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+        if (h + n - r->tail_cache <= r->mask + 1) {
+            break;
+        }
+
+        atomic_store(&r->producer_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        r->tail_cache = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+        if (h + n - r->tail_cache > r->mask + 1) {
+            ring_futex(&r->producer_waiting, FUTEX_WAIT, 1);
+        }
+    }
+}
+
+// Pushes n records (n at most capacity) with one publish and one fence
+
+static inline void ring_push_batch(struct ring * r, const struct ring_rec * recs, uint64_t n) {
+
+    uint64_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    ring_reserve(r, h, n);
+
+    for (uint64_t i = 0; i < n; i++) {
+        r->recs[(h + i) & r->mask] = recs[i];
+    }
+
+    atomic_store_explicit(&r->head, h + n, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(&r->consumer_idle, memory_order_relaxed)) {
+        ring_wake_consumer(r);
+    }
+}
+
+static inline void ring_push(struct ring * r, const struct ring_rec * rec) {
+    ring_push_batch(r, rec, 1);
+}
+
+// Last push done, consumer stops watching the ring once it is drained
+
+static inline void ring_close(struct ring * r) {
+
+    uint64_t one = 1;
+
+    atomic_store(&r->closed, 1);
+    atomic_store(&r->consumer_idle, 0);
+
+    if (write(r->efd, &one, sizeof(one)) < 0 && EAGAIN != errno) {
+        perror("ring eventfd");
+    }
+}
+
+// Consumer side: copies up to max records, frees their slots at once
+
+static inline int ring_pop(struct ring * r, struct ring_rec * out, int max) {
+
+    uint64_t t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint64_t n;
+
+    if (t == r->head_cache) {
+
+        r->head_cache = atomic_load_explicit(&r->head, memory_order_acquire);
+
+        if (t == r->head_cache) {
+            return 0;
+        }
+    }
+
+    n = r->head_cache - t < (uint64_t) max ? r->head_cache - t : (uint64_t) max;
+
+    for (uint64_t i = 0; i < n; i++) {
+        out[i] = r->recs[(t + i) & r->mask];
+    }
+
+    atomic_store_explicit(&r->tail, t + n, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(&r->producer_waiting, memory_order_relaxed) && atomic_exchange(&r->producer_waiting, 0)) {
+        ring_futex(&r->producer_waiting, FUTEX_WAKE, 1);
+    }
+
+    return n;
+}
+
+// Blocks until the ring has records or is closed, for a consumer of one ring
+
+static inline void ring_wait(struct ring * r) {
+
+    struct pollfd pfd[2] = {{r->efd, POLLIN, 0}, {r->producer_fd, POLLIN, 0}};
+    uint64_t drain;
+
+    atomic_store(&r->consumer_idle, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load(&r->head) == atomic_load(&r->tail) && !atomic_load(&r->closed)) {
+
+        if (poll(pfd, r->producer_fd >= 0 ? 2 : 1, -1) < 0 && EINTR != errno) {
+            perror("ring poll");
+        }
+
+        if (r->producer_fd >= 0 && pfd[1].revents) {
+            atomic_store(&r->closed, 1);
+        }
+
+        if (read(r->efd, &drain, sizeof(drain)) < 0 && EAGAIN != errno) {
+            perror("ring eventfd");
+        }
+    }
+
+    atomic_store(&r->consumer_idle, 0);
+}
+
+struct ring_stats {
+    long long records;
+    long long batches;
+    long long sleeps;
+};
+
+// Drains all rings in one epoll loop until every producer closed its ring
+// (or died, when watched) and it is empty. handle gets the ring index and a
+// batch of records
+
+static inline void ring_consume(struct ring ** rings, int n, void (*handle)(int, struct ring_rec *, int),
+                                struct ring_stats * st) {
+
+    struct ring_rec batch[RING_BATCH];
+    struct epoll_event ev, evs[64];
+    char done[n];
+    int open = n, epfd, got, k;
+    uint64_t drain;
+
+    memset(st, 0, sizeof(struct ring_stats));
+    memset(done, 0, n);
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1");
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, rings[i]->efd, &ev) < 0) {
+            perror("epoll_ctl");
+        }
+
+        // Producer's exit comes as n + i
+
+        ev.data.u32 = n + i;
+
+        if (rings[i]->producer_fd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, rings[i]->producer_fd, &ev) < 0) {
+            perror("epoll_ctl");
+        }
+    }
+
+    while (open > 0) {
+
+        got = 0;
+
+        for (int i = 0; i < n; i++) {
+
+            if (done[i]) {
+                continue;
+            }
+
+            // A closed ring is finished once a pop after seeing the flag is empty
+
+            int closed = atomic_load(&rings[i]->closed);
+
+            if ((k = ring_pop(rings[i], batch, RING_BATCH)) > 0) {
+                handle(i, batch, k);
+                st->records += k;
+                st->batches++;
+                got += k;
+            } else if (closed) {
+                done[i] = 1;
+                open--;
+            }
+        }
+
+        if (got || !open) {
+            continue;
+        }
+
+        // Nothing anywhere: announce idle, look once more, then sleep
+
+        for (int i = 0; i < n; i++) {
+            atomic_store(&rings[i]->consumer_idle, 1);
+        }
+
+        atomic_thread_fence(memory_order_seq_cst);
+
+        for (int i = 0; i < n && !got; i++) {
+            got = !done[i] && (atomic_load(&rings[i]->head) != atomic_load(&rings[i]->tail)
+                               || atomic_load(&rings[i]->closed));
+        }
+
+        if (!got) {
+
+            st->sleeps++;
+            k = epoll_wait(epfd, evs, 64, -1);
+
+            for (int i = 0; i < k; i++) {
+
+                int r = evs[i].data.u32;
+
+                // Dead producer publishes nothing more, ring is drained and done
+
+                if (r >= n) {
+                    atomic_store(&rings[r - n]->closed, 1);
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, rings[r - n]->producer_fd, NULL);
+                } else if (read(rings[r]->efd, &drain, sizeof(drain)) < 0 && EAGAIN != errno) {
+                    perror("ring eventfd");
+                }
+            }
+        }
+
+        for (int i = 0; i < n; i++) {
+            atomic_store(&rings[i]->consumer_idle, 0);
+        }
+    }
+
+    close(epfd);
+}
+
+#endif
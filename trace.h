@@ -0,0 +1,211 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Binary event trace. Every process writes fixed-size records (timestamp,
+// pid, event type, two arguments) into its own ring, a MAP_SHARED file
+// TRACE/trace.<pid>.bin, so records survive the process and nothing is
+// formatted on the hot path. A record is one relaxed atomic increment, one
+// vDSO clock read and a 32-byte store, cheap enough for signal handlers.
+// bin/trace2json merges the rings into Chrome trace / Perfetto JSON.
+//
+// Tracing is switched on with TRACE environment variable naming the output
+// directory, the same way PACE and VTIME work. Without it every trace_*
+// call is a single predictable branch. Children forked after trace_init
+// open their own ring automatically (pthread_atfork), exit is recorded
+// with its status through on_exit.
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define TRACE_MAGIC 0x31454341525442ULL
+#define TRACE_VERSION 2
+#define TRACE_DEFAULT_RECORDS (1 << 16)
+
+// Event types, a0 and a1 meaning in comments
+
+#define TR_START 1      // ppid
+#define TR_FORK 2       // child pid
+#define TR_EXIT 3       // exit status
+#define TR_REAP 4       // child pid, wait status
+#define TR_SIG_SEND 5   // target pid (negative: group, never 0), signal
+#define TR_SIG_RECV 6   // signal, process group of the receiver
+#define TR_IO_BEGIN 7   // block, bytes requested
+#define TR_IO_END 8     // block, bytes transferred
+
+struct trace_rec {
+    uint64_t ts_ns;
+    int32_t pid;
+    uint16_t type;
+    uint16_t flags;
+    int64_t a0;
+    int64_t a1;
+};
+
+// Ring file: header on its own cache line, records follow. head counts
+// records ever written, slot is head modulo capacity (a power of two)
+
+struct trace_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t rec_size;
+    uint64_t capacity;
+    int32_t pid;
+    int32_t ppid;
+    _Atomic uint64_t head;
+    char pad[24];
+};
+
+static struct trace_header * trace_ring = NULL;
+static struct trace_rec * trace_recs = NULL;
+static uint64_t trace_mask = 0;
+static int32_t trace_pid = 0;
+
+static inline void trace_event(int type, int64_t a0, int64_t a1) {
+
+    if (!trace_ring) {
+        return;
+    }
+
+    uint64_t i = atomic_fetch_add_explicit(&trace_ring->head, 1, memory_order_relaxed);
+    struct trace_rec * r = &trace_recs[i & trace_mask];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    r->ts_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    r->pid = trace_pid;
+    r->type = type;
+    r->flags = 0;
+    r->a0 = a0;
+    r->a1 = a1;
+}
+
+// Creates ring of the calling process, tracing stays off if it can't
+
+static inline void trace_open_ring(void) {
+
+    char path[512];
+    char * dir = getenv("TRACE");
+    char * env = getenv("TRACE_RECORDS");
+    uint64_t cap = TRACE_DEFAULT_RECORDS;
+    int fd;
+
+    // Capacity rounded up to a power of two
+
+    if (env && atoll(env) > 0) {
+        for (cap = 1; cap < (uint64_t) atoll(env); cap <<= 1);
+    }
+
+    size_t size = sizeof(struct trace_header) + cap * sizeof(struct trace_rec);
+
+    trace_pid = getpid();
+    snprintf(path, sizeof(path), "%s/trace.%d.bin", dir, trace_pid);
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        perror("trace open");
+        return;
+    }
+
+    if (ftruncate(fd, size) < 0) {
+        perror("trace ftruncate");
+        close(fd);
+        return;
+    }
+
+    void * p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (p == MAP_FAILED) {
+        perror("trace mmap");
+        return;
+    }
+
+    trace_ring = p;
+    trace_recs = (struct trace_rec *) (trace_ring + 1);
+    trace_mask = cap - 1;
+    trace_ring->version = TRACE_VERSION;
+    trace_ring->rec_size = sizeof(struct trace_rec);
+    trace_ring->capacity = cap;
+    trace_ring->pid = trace_pid;
+    trace_ring->ppid = getppid();
+    atomic_store(&trace_ring->head, 0);
+
+    // Magic last, converter skips rings that were never set up
+
+    trace_ring->magic = TRACE_MAGIC;
+    trace_event(TR_START, trace_ring->ppid, 0);
+}
+
+// Child must not write into parent's ring, it gets its own
+
+static inline void trace_atfork_child(void) {
+
+    if (!trace_ring) {
+        return;
+    }
+
+    munmap(trace_ring, sizeof(struct trace_header) + (trace_mask + 1) * sizeof(struct trace_rec));
+    trace_ring = NULL;
+    trace_open_ring();
+}
+
+static inline void trace_on_exit(int status, void * arg) {
+    (void) arg;
+    trace_event(TR_EXIT, status, 0);
+}
+
+static inline void trace_init(void) {
+
+    if (!getenv("TRACE") || trace_ring) {
+        return;
+    }
+
+    trace_open_ring();
+
+    if (trace_ring) {
+        pthread_atfork(NULL, NULL, trace_atfork_child);
+        on_exit(trace_on_exit, NULL);
+    }
+}
+
+static inline void trace_fork(pid_t child) {
+    trace_event(TR_FORK, child, 0);
+}
+
+static inline void trace_reap(pid_t child, int status) {
+    trace_event(TR_REAP, child, status);
+}
+
+// kill(0, ...) is recorded with the group it reaches, and a receive with
+// the receiver's group, so the converter can tell members of a group send.
+// getpgrp is async-signal-safe, called only when tracing is on
+
+static inline void trace_kill(pid_t target, int sig) {
+    if (trace_ring) {
+        trace_event(TR_SIG_SEND, target ? target : -getpgrp(), sig);
+    }
+}
+
+static inline void trace_signal(int sig) {
+    if (trace_ring) {
+        trace_event(TR_SIG_RECV, sig, getpgrp());
+    }
+}
+
+static inline void trace_io_begin(int64_t block, int64_t bytes) {
+    trace_event(TR_IO_BEGIN, block, bytes);
+}
+
+static inline void trace_io_end(int64_t block, int64_t bytes) {
+    trace_event(TR_IO_END, block, bytes);
+}
+
+#endif
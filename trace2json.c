@@ -0,0 +1,424 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+#define ERR(source) (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), \
+                    perror(source), exit(EXIT_FAILURE))
+
+// Offline converter of trace rings (trace.h) to Chrome trace JSON, loads in
+// chrome://tracing and ui.perfetto.dev. Every process is a track, I/O blocks
+// are duration slices, the rest are instant events with arguments. Signal
+// sends are tied to the matching receives with flow arrows when a receive
+// of that signal happens in the target later on.
+
+// flow and from (index of the send) are set on receives only, a group send
+// can start several arrows
+
+struct event {
+    struct trace_rec rec;
+    int flow;
+    long from;
+};
+
+struct event * events = NULL;
+size_t event_count = 0, event_cap = 0;
+
+void add_event(struct trace_rec * r) {
+
+    if (event_count == event_cap) {
+
+        event_cap = event_cap ? 2 * event_cap : 4096;
+
+        if (!(events = realloc(events, event_cap * sizeof(struct event)))) {
+            ERR("realloc");
+        }
+    }
+
+    events[event_count].rec = *r;
+    events[event_count].flow = 0;
+    events[event_count].from = -1;
+    event_count++;
+}
+
+// Copies the live part of one ring, oldest record first. Returns number of
+// records lost to wrap-around
+
+long long load_ring(const char * path) {
+
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        ERR("open");
+    }
+
+    if (fstat(fd, &st) < 0) {
+        ERR("fstat");
+    }
+
+    if ((size_t) st.st_size < sizeof(struct trace_header)) {
+        close(fd);
+        return 0;
+    }
+
+    struct trace_header * h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (h == MAP_FAILED) {
+        ERR("mmap");
+    }
+
+    if (h->magic != TRACE_MAGIC || h->version != TRACE_VERSION || h->rec_size != sizeof(struct trace_rec)
+        || sizeof(struct trace_header) + h->capacity * sizeof(struct trace_rec) > (size_t) st.st_size) {
+        fprintf(stderr, "%s: not a trace ring, skipped\n", path);
+        munmap(h, st.st_size);
+        return 0;
+    }
+
+    struct trace_rec * recs = (struct trace_rec *) (h + 1);
+    uint64_t head = atomic_load(&h->head);
+    uint64_t first = head > h->capacity ? head - h->capacity : 0;
+
+    for (uint64_t i = first; i < head; i++) {
+        add_event(&recs[i & (h->capacity - 1)]);
+    }
+
+    munmap(h, st.st_size);
+    return first;
+}
+
+int cmp_event(const void * a, const void * b) {
+
+    const struct trace_rec * x = &((const struct event *) a)->rec;
+    const struct trace_rec * y = &((const struct event *) b)->rec;
+
+    if (x->ts_ns != y->ts_ns) {
+        return x->ts_ns < y->ts_ns ? -1 : 1;
+    }
+
+    return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+// Pairs every receive with the latest earlier unpaired send of the same
+// signal addressed to the receiver, directly or through its process group
+// (trace.h records both sides' group). A group send pairs once with every
+// member that receives it, so kill(0, ...) to N children draws N arrows.
+// Coalesced sends stay unpaired.
+//
+// Direct sends wait on one stack per (receiver, signal). Group sends go to
+// a log per (group, signal) and a member copies the entries it hasn't seen
+// yet (newer than its start) onto its own stack when it receives. Stacks
+// are lists of nodes, logs are chained through below[], and their tops live
+// in an open-addressing table, so a receive looks at a few tops instead of
+// scanning back through the whole trace
+
+#define FLOW_GROUP (1 << 16)
+#define FLOW_START (1 << 17)
+
+struct flow_slot {
+    int64_t target;
+    int64_t sig;
+    long top;
+    long seen;
+};
+
+struct flow_node {
+    long event;
+    long below;
+};
+
+struct flow_node * nodes = NULL;
+size_t node_count = 0, node_cap = 0;
+
+void flow_push(struct flow_slot * f, long event) {
+
+    if (node_count == node_cap) {
+
+        node_cap = node_cap ? 2 * node_cap : 4096;
+
+        if (!(nodes = realloc(nodes, node_cap * sizeof(struct flow_node)))) {
+            ERR("realloc");
+        }
+    }
+
+    nodes[node_count].event = event;
+    nodes[node_count].below = f->top;
+    f->top = node_count++;
+}
+
+// Key is (target, sig): target is a receiver pid or minus a group, sig also
+// carries FLOW_GROUP for a member's copy of group sends and FLOW_START for
+// the slot holding process start
+
+struct flow_slot * flow_find(struct flow_slot * table, size_t cap, int64_t target, int64_t sig) {
+
+    uint64_t h = (uint64_t) target * 0x9E3779B97F4A7C15ULL ^ (uint64_t) sig * 0xC2B2AE3D27D4EB4FULL;
+
+    // Linear probing, sig 0 marks a free slot (no signal has number 0)
+
+    for (h ^= h >> 29;; h++) {
+
+        struct flow_slot * f = &table[h & (cap - 1)];
+
+        if (!f->sig) {
+            f->target = target;
+            f->sig = sig;
+            f->top = f->seen = -1;
+            return f;
+        }
+
+        if (f->target == target && f->sig == sig) {
+            return f;
+        }
+    }
+}
+
+// Moves group sends newer than what the member has seen onto its stack,
+// oldest first so the newest ends on top
+
+void flow_copy(struct flow_slot * log, struct flow_slot * mine, long * below, long * walk) {
+
+    long n = 0;
+
+    for (long j = log->top; j > mine->seen; j = below[j]) {
+        walk[n++] = j;
+    }
+
+    while (n > 0) {
+        flow_push(mine, walk[--n]);
+    }
+
+    if (log->top > mine->seen) {
+        mine->seen = log->top;
+    }
+}
+
+void match_flows(void) {
+
+    int next_flow = 1;
+    size_t cap = 16;
+    struct flow_slot * table;
+    long * below, * walk;
+
+    // At most four keys per event, table stays at most half full
+
+    while (cap < 8 * event_count) {
+        cap <<= 1;
+    }
+
+    if (!(table = calloc(cap, sizeof(struct flow_slot))) || !(below = malloc((event_count + 1) * sizeof(long)))
+        || !(walk = malloc((event_count + 1) * sizeof(long)))) {
+        ERR("calloc");
+    }
+
+    for (size_t i = 0; i < event_count; i++) {
+
+        struct trace_rec * r = &events[i].rec;
+
+        if (r->type == TR_START) {
+            flow_find(table, cap, r->pid, FLOW_START)->top = i;
+        } else if (r->type == TR_SIG_SEND && r->a0 > 0) {
+            flow_push(flow_find(table, cap, r->a0, r->a1), i);
+        } else if (r->type == TR_SIG_SEND) {
+
+            struct flow_slot * log = flow_find(table, cap, r->a0, r->a1);
+
+            below[i] = log->top;
+            log->top = i;
+        } else if (r->type == TR_SIG_RECV) {
+
+            struct flow_slot * direct = flow_find(table, cap, r->pid, r->a0);
+            struct flow_slot * mine = flow_find(table, cap, r->pid, r->a0 + FLOW_GROUP);
+            struct flow_slot * f;
+
+            // First receive: group sends from before the member existed don't count
+
+            if (mine->seen < 0) {
+                mine->seen = flow_find(table, cap, r->pid, FLOW_START)->top;
+            }
+
+            if (r->a1 > 0) {
+                flow_copy(flow_find(table, cap, -r->a1, r->a0), mine, below, walk);
+            }
+
+            if (direct->top < 0) {
+                f = mine;
+            } else if (mine->top < 0) {
+                f = direct;
+            } else {
+                f = nodes[direct->top].event > nodes[mine->top].event ? direct : mine;
+            }
+
+            if (f->top >= 0) {
+                events[i].from = nodes[f->top].event;
+                events[i].flow = next_flow++;
+                f->top = nodes[f->top].below;
+            }
+        }
+    }
+
+    free(table);
+    free(below);
+    free(walk);
+    free(nodes);
+}
+
+const char * event_name(int type) {
+    switch (type) {
+        case TR_START:
+            return "start";
+        case TR_FORK:
+            return "fork";
+        case TR_EXIT:
+            return "exit";
+        case TR_REAP:
+            return "reap";
+        case TR_SIG_SEND:
+            return "kill";
+        case TR_SIG_RECV:
+            return "signal";
+        default:
+            return "io";
+    }
+}
+
+void write_json(FILE * f, uint64_t t0) {
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    for (size_t i = 0; i < event_count; i++) {
+
+        struct trace_rec * r = &events[i].rec;
+        double ts = (r->ts_ns - t0) / 1000.0;
+        const char * sep = i + 1 < event_count ? ",\n" : "\n";
+
+        switch (r->type) {
+
+            case TR_IO_BEGIN:
+            case TR_IO_END:
+                fprintf(f, "{\"name\":\"block %lld\",\"cat\":\"io\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,"
+                        "\"args\":{\"bytes\":%lld}}", (long long) r->a0, r->type == TR_IO_BEGIN ? "B" : "E",
+                        ts, r->pid, r->pid, (long long) r->a1);
+                break;
+
+            case TR_SIG_SEND:
+            case TR_SIG_RECV: {
+
+                int sig = r->type == TR_SIG_SEND ? r->a1 : r->a0;
+
+                fprintf(f, "{\"name\":\"%s %s\",\"cat\":\"signal\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,"
+                        "\"tid\":%d,\"args\":{\"target\":%lld,\"signal\":%d}}", event_name(r->type),
+                        sigabbrev_np(sig) ? sigabbrev_np(sig) : "?", ts, r->pid, r->pid,
+                        r->type == TR_SIG_SEND ? (long long) r->a0 : (long long) r->pid, sig);
+
+                // Both ends of the arrow go out with the receive, the viewer
+                // binds them by timestamp and pid
+
+                if (events[i].flow) {
+
+                    struct trace_rec * s = &events[events[i].from].rec;
+
+                    fprintf(f, ",\n{\"name\":\"signal\",\"cat\":\"signal\",\"ph\":\"s\",\"bp\":\"e\",\"id\":%d,"
+                            "\"ts\":%.3f,\"pid\":%d,\"tid\":%d}", events[i].flow, (s->ts_ns - t0) / 1000.0, s->pid,
+                            s->pid);
+                    fprintf(f, ",\n{\"name\":\"signal\",\"cat\":\"signal\",\"ph\":\"f\",\"bp\":\"e\",\"id\":%d,"
+                            "\"ts\":%.3f,\"pid\":%d,\"tid\":%d}", events[i].flow, ts, r->pid, r->pid);
+                }
+                break;
+            }
+
+            default:
+                fprintf(f, "{\"name\":\"%s\",\"cat\":\"process\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,"
+                        "\"tid\":%d,\"args\":{\"a0\":%lld,\"a1\":%lld}}", event_name(r->type), ts, r->pid, r->pid,
+                        (long long) r->a0, (long long) r->a1);
+        }
+
+        fputs(sep, f);
+    }
+
+    fprintf(f, "]}\n");
+}
+
+void usage(char * name) {
+    fprintf(stderr, "USAGE: %s dir|ring... [-o out.json]\n", name);
+    fprintf(stderr, "dir - directory given in TRACE, all trace.*.bin in it are merged\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char ** argv) {
+
+    FILE * out = stdout;
+    char path[4096];
+    long long lost = 0;
+    int opt, rings = 0;
+
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        if ('o' == opt) {
+            if (!(out = fopen(optarg, "w"))) {
+                ERR("fopen");
+            }
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (optind == argc) {
+        usage(argv[0]);
+    }
+
+    for (int i = optind; i < argc; i++) {
+
+        struct stat st;
+
+        if (stat(argv[i], &st) < 0) {
+            ERR("stat");
+        }
+
+        if (!S_ISDIR(st.st_mode)) {
+            lost += load_ring(argv[i]);
+            rings++;
+            continue;
+        }
+
+        DIR * d = opendir(argv[i]);
+        struct dirent * e;
+
+        if (!d) {
+            ERR("opendir");
+        }
+
+        while ((e = readdir(d))) {
+            if (!strncmp(e->d_name, "trace.", 6) && strstr(e->d_name, ".bin")) {
+                snprintf(path, sizeof(path), "%s/%s", argv[i], e->d_name);
+                lost += load_ring(path);
+                rings++;
+            }
+        }
+
+        closedir(d);
+    }
+
+    qsort(events, event_count, sizeof(struct event), cmp_event);
+    match_flows();
+    write_json(out, event_count ? events[0].rec.ts_ns : 0);
+
+    fprintf(stderr, "%d rings, %zu events, %lld lost to wrap-around\n", rings, event_count, lost);
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    free(events);
+    return EXIT_SUCCESS;
+}
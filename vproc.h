@@ -0,0 +1,989 @@
+#ifndef VPROC_H
+#define VPROC_H
+
+// Virtual processes: workers of the sleep-based labs run as stackful
+// coroutines (ucontext) inside one OS process instead of being forked.
+// Scheduling is cooperative, a virtual process runs until it sleeps, waits
+// or exits. Sleeps and alarms take real time, signals become in-process
+// events delivered between coroutine switches, so a worker costs a small
+// descriptor and the stack pages it actually touched.
+//
+// Engine is switched on with VPROC environment variable, the same way PACE
+// works. VTIME switches it on too, with the virtual clock of vtime.h in
+// place of the real one. Every vp_* call falls back to the real system
+// call when the engine isn't running, so worker code is shared by all modes.
+//
+// Emulated semantics:
+//   - fork is vp_spawn, child inherits dispositions and private variables
+//   - signal with a handler interrupts vp_sleep / vp_nanosleep / vp_wait,
+//     pending signals are coalesced and handled lowest number first
+//   - SIG_DFL terminates the target (except SIGCHLD), SIG_IGN drops it
+//   - no SIGCHLD is generated, parents reap children with vp_wait or
+//     vp_waitpid, which doesn't tell process groups apart
+//   - FUTEX_WAIT / FUTEX_WAKE (vp_futex_wait / vp_futex_wake) block and
+//     wake virtual processes, waiting is interrupted by caught signals
+//
+// Globals that differ between processes (last_signal and the like) have to
+// be registered with vp_private, they are swapped in and out on every switch.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "vtime.h"
+
+#define VP_STACK_SIZE (64 * 1024)
+#define VP_STACKS_PER_CHUNK 256
+#define VP_SCHED_STACK_SIZE (256 * 1024)
+#define VP_MAX_PRIVATE 8
+#define VP_NSIG 32
+
+// Root (the process calling vp_init) is VP_PID_BASE, spawned processes
+// follow it
+
+#define VP_PID_BASE 1000
+
+#define VP_READY 0
+#define VP_RUNNING 1
+#define VP_SLEEPING 2
+#define VP_WAITING 3
+#define VP_ZOMBIE 4
+#define VP_FUTEX 5
+
+#define VP_TIMER_WAKE 0
+#define VP_TIMER_ALARM 1
+
+struct vproc {
+    ucontext_t ctx;
+    void * stack;
+    pid_t pid;
+    pid_t pgid;
+    struct vproc * parent;
+    int state;
+    int interrupted;
+
+    // Process group membership and zombie list of the parent
+
+    struct vproc * pg_prev;
+    struct vproc * pg_next;
+    struct vproc * zombie_next;
+    struct vproc * zombies;
+    int children;
+
+    // Futex waiter list, all addresses in one list
+
+    void * futex_addr;
+    struct vproc * fx_prev;
+    struct vproc * fx_next;
+
+    // Timers are cancelled by bumping the token, heap entries are lazy
+
+    long long wake_ns;
+    unsigned long long sleep_token;
+    unsigned long long alarm_token;
+    long long alarm_ns;
+
+    unsigned int pending;
+    void (*handlers[VP_NSIG])(int);
+    void (*fn)(void *);
+    void * arg;
+    char * priv;
+};
+
+struct vp_timer {
+    long long when;
+    unsigned long long seq;
+    unsigned long long token;
+    struct vproc * vp;
+    int kind;
+};
+
+struct vp_private_var {
+    void * addr;
+    size_t size;
+    size_t offset;
+};
+
+static ucontext_t vp_sched_ctx;
+static struct vproc * vp_current = NULL;
+static struct vproc ** vp_table = NULL;
+static struct vproc ** vp_pg_heads = NULL;
+static int vp_table_size = 0;
+static int vp_table_cap = 0;
+static int vp_pg_cap = 0;
+
+static struct vproc ** vp_ready = NULL;
+static int vp_ready_head = 0;
+static int vp_ready_count = 0;
+static int vp_ready_cap = 0;
+
+static struct vp_timer * vp_timers = NULL;
+static int vp_timer_count = 0;
+static int vp_timer_cap = 0;
+static unsigned long long vp_timer_seq = 0;
+
+static void ** vp_free_stacks = NULL;
+static int vp_free_stack_count = 0;
+static int vp_free_stack_cap = 0;
+static size_t vp_guard = 0;
+static long vp_guards_left = 0;
+
+static struct vproc * vp_futex_waiters = NULL;
+
+static struct vp_private_var vp_privates[VP_MAX_PRIVATE];
+static int vp_private_count = 0;
+static size_t vp_private_size = 0;
+
+static inline void vp_die(const char * what) {
+    fprintf(stderr, "vproc: %s\n", what);
+    abort();
+}
+
+static inline int vp_enabled(void) {
+    return getenv("VPROC") != NULL || vt_enabled();
+}
+
+static inline int vp_active(void) {
+    return vp_current != NULL;
+}
+
+static inline long long vp_now(void) {
+
+    struct timespec ts;
+
+    if (vt_active()) {
+        return vt_now();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Counterpart of time(NULL), follows the virtual clock under VTIME
+
+static inline time_t vp_time(void) {
+    return vt_active() ? vt_now() / 1000000000LL : time(NULL);
+}
+
+// Grows array *p of *cap elements of given size so it holds at least need
+
+static inline void vp_grow(void * p, int * cap, int need, size_t size) {
+
+    if (need <= *cap) {
+        return;
+    }
+
+    int c = *cap ? *cap : 64;
+
+    while (c < need) {
+        c *= 2;
+    }
+
+    void * n = realloc(*(void **) p, c * size);
+
+    if (!n) {
+        vp_die("out of memory");
+    }
+
+    *(void **) p = n;
+    *cap = c;
+}
+
+// Registers a global that every virtual process has its own copy of
+
+static inline void vp_private(void * addr, size_t size) {
+
+    if (vp_private_count == VP_MAX_PRIVATE || vp_table_size) {
+        vp_die("vp_private must be called before vp_init");
+    }
+
+    vp_privates[vp_private_count].addr = addr;
+    vp_privates[vp_private_count].size = size;
+    vp_privates[vp_private_count].offset = vp_private_size;
+    vp_private_count++;
+    vp_private_size += size;
+}
+
+static inline void vp_save_private(struct vproc * vp) {
+    for (int i = 0; i < vp_private_count; i++) {
+        memcpy(vp->priv + vp_privates[i].offset, vp_privates[i].addr, vp_privates[i].size);
+    }
+}
+
+static inline void vp_load_private(struct vproc * vp) {
+    for (int i = 0; i < vp_private_count; i++) {
+        memcpy(vp_privates[i].addr, vp->priv + vp_privates[i].offset, vp_privates[i].size);
+    }
+}
+
+// Stacks are carved from big MAP_NORESERVE chunks, only touched pages are
+// ever backed. Lowest page of every stack is a PROT_NONE guard, so an
+// overflow faults instead of silently running into the stack below. Each
+// guard splits the mapping into two map entries, so guards may take only
+// a quarter of vm.max_map_count (about 16k stacks by default), the rest is
+// left to malloc and friends. Stacks past that go without a guard, which
+// is reported once
+
+static inline void * vp_stack_alloc(void) {
+
+    if (!vp_free_stack_count) {
+
+        char * chunk = mmap(NULL, (size_t) VP_STACK_SIZE * VP_STACKS_PER_CHUNK, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+
+        if (chunk == MAP_FAILED) {
+            vp_die("stack mmap failed");
+        }
+
+        vp_grow(&vp_free_stacks, &vp_free_stack_cap, VP_STACKS_PER_CHUNK, sizeof(void *));
+
+        for (int i = VP_STACKS_PER_CHUNK - 1; i >= 0; i--) {
+
+            char * stack = chunk + (size_t) i * VP_STACK_SIZE;
+
+            if (vp_guards_left > 0) {
+
+                if (mprotect(stack, vp_guard, PROT_NONE) < 0) {
+                    vp_die("guard page mprotect failed");
+                }
+
+                if (!--vp_guards_left) {
+                    fprintf(stderr, "vproc: guard page budget used up, further stacks have none\n");
+                }
+            }
+
+            vp_free_stacks[vp_free_stack_count++] = stack;
+        }
+    }
+
+    return vp_free_stacks[--vp_free_stack_count];
+}
+
+static inline void vp_stack_free(void * stack) {
+    vp_grow(&vp_free_stacks, &vp_free_stack_cap, vp_free_stack_count + 1, sizeof(void *));
+    vp_free_stacks[vp_free_stack_count++] = stack;
+}
+
+// Ready queue is a ring buffer, unrolled into a twice bigger one when full
+
+static inline void vp_make_ready(struct vproc * vp) {
+
+    if (vp_ready_count == vp_ready_cap) {
+
+        int cap = vp_ready_cap ? 2 * vp_ready_cap : 64;
+        struct vproc ** q = malloc(cap * sizeof(struct vproc *));
+
+        if (!q) {
+            vp_die("out of memory");
+        }
+
+        for (int i = 0; i < vp_ready_count; i++) {
+            q[i] = vp_ready[(vp_ready_head + i) % vp_ready_cap];
+        }
+
+        free(vp_ready);
+        vp_ready = q;
+        vp_ready_head = 0;
+        vp_ready_cap = cap;
+    }
+
+    vp->state = VP_READY;
+    vp_ready[(vp_ready_head + vp_ready_count++) % vp_ready_cap] = vp;
+}
+
+static inline struct vproc * vp_next_ready(void) {
+
+    struct vproc * vp = vp_ready[vp_ready_head];
+
+    vp_ready_head = (vp_ready_head + 1) % vp_ready_cap;
+    vp_ready_count--;
+    return vp;
+}
+
+// Timer min-heap ordered by (when, seq)
+
+static inline int vp_timer_before(struct vp_timer * a, struct vp_timer * b) {
+    return a->when < b->when || (a->when == b->when && a->seq < b->seq);
+}
+
+static inline void vp_timer_add(struct vproc * vp, long long when, int kind, unsigned long long token) {
+
+    vp_grow(&vp_timers, &vp_timer_cap, vp_timer_count + 1, sizeof(struct vp_timer));
+
+    struct vp_timer t = {when, vp_timer_seq++, token, vp, kind};
+    int i = vp_timer_count++;
+
+    while (i > 0 && vp_timer_before(&t, &vp_timers[(i - 1) / 2])) {
+        vp_timers[i] = vp_timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+
+    vp_timers[i] = t;
+}
+
+static inline struct vp_timer vp_timer_pop(void) {
+
+    struct vp_timer top = vp_timers[0];
+    struct vp_timer last = vp_timers[--vp_timer_count];
+    int i = 0;
+
+    for (;;) {
+
+        int c = 2 * i + 1;
+
+        if (c >= vp_timer_count) {
+            break;
+        }
+
+        if (c + 1 < vp_timer_count && vp_timer_before(&vp_timers[c + 1], &vp_timers[c])) {
+            c++;
+        }
+
+        if (!vp_timer_before(&vp_timers[c], &last)) {
+            break;
+        }
+
+        vp_timers[i] = vp_timers[c];
+        i = c;
+    }
+
+    if (vp_timer_count) {
+        vp_timers[i] = last;
+    }
+
+    return top;
+}
+
+static inline void vp_post(struct vproc * vp, int sig);
+
+// Fires all timers due at now, stale entries (cancelled sleeps and alarms)
+// are just dropped
+
+static inline void vp_expire(long long now) {
+
+    while (vp_timer_count && vp_timers[0].when <= now) {
+
+        struct vp_timer t = vp_timer_pop();
+
+        if (VP_TIMER_WAKE == t.kind) {
+            if ((VP_SLEEPING == t.vp->state || VP_FUTEX == t.vp->state) && t.token == t.vp->sleep_token) {
+                vp_make_ready(t.vp);
+            }
+        } else if (t.token == t.vp->alarm_token && t.vp->state != VP_ZOMBIE) {
+            t.vp->alarm_ns = 0;
+            vp_post(t.vp, SIGALRM);
+        }
+    }
+}
+
+// Scheduler loop, runs on its own stack. Private variables are loaded
+// before a process is resumed and saved after it gives the CPU back
+
+static inline void vp_schedule(void) {
+
+    for (;;) {
+
+        vp_expire(vp_now());
+
+        if (!vp_ready_count) {
+
+            if (!vp_timer_count) {
+                vp_die("all virtual processes blocked");
+            }
+
+            // Virtual clock just jumps to the next timer
+
+            if (vt_active()) {
+                vt_advance(vp_timers[0].when);
+                continue;
+            }
+
+            struct timespec ts = {vp_timers[0].when / 1000000000LL, vp_timers[0].when % 1000000000LL};
+
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            continue;
+        }
+
+        struct vproc * vp = vp_next_ready();
+
+        vp->state = VP_RUNNING;
+        vp_current = vp;
+        vp_load_private(vp);
+
+        if (swapcontext(&vp_sched_ctx, &vp->ctx) < 0) {
+            vp_die("swapcontext failed");
+        }
+
+        if (VP_ZOMBIE == vp->state) {
+            vp_stack_free(vp->stack);
+            vp->stack = NULL;
+        } else {
+            vp_save_private(vp);
+        }
+    }
+}
+
+// Gives CPU back to the scheduler and runs handlers of signals that came
+// in the meantime once resumed
+
+static inline void vp_deliver(void);
+
+static inline void vp_block(int state) {
+
+    vp_current->state = state;
+
+    if (swapcontext(&vp_current->ctx, &vp_sched_ctx) < 0) {
+        vp_die("swapcontext failed");
+    }
+
+    vp_deliver();
+}
+
+// Takes vp off the futex waiter list
+
+static inline void vp_futex_unlink(struct vproc * vp) {
+
+    if (vp->fx_prev) {
+        vp->fx_prev->fx_next = vp->fx_next;
+    } else {
+        vp_futex_waiters = vp->fx_next;
+    }
+
+    if (vp->fx_next) {
+        vp->fx_next->fx_prev = vp->fx_prev;
+    }
+
+    vp->futex_addr = NULL;
+}
+
+static inline void vp_exit(void) {
+
+    struct vproc * vp = vp_current;
+    struct vproc * parent = vp->parent;
+
+    // Leaving process group
+
+    if (vp->pg_prev) {
+        vp->pg_prev->pg_next = vp->pg_next;
+    } else {
+        vp_pg_heads[vp->pgid - VP_PID_BASE] = vp->pg_next;
+    }
+
+    if (vp->pg_next) {
+        vp->pg_next->pg_prev = vp->pg_prev;
+    }
+
+    // Signal with default action may end it while waiting on a futex
+
+    if (vp->futex_addr) {
+        vp_futex_unlink(vp);
+    }
+
+    vp->state = VP_ZOMBIE;
+    vp->alarm_token++;
+    vp->zombie_next = parent->zombies;
+    parent->zombies = vp;
+
+    if (VP_WAITING == parent->state) {
+        vp_make_ready(parent);
+    }
+
+    setcontext(&vp_sched_ctx);
+    vp_die("setcontext failed");
+}
+
+static inline void vp_deliver(void) {
+
+    struct vproc * vp = vp_current;
+
+    while (vp->pending) {
+
+        int sig = __builtin_ctz(vp->pending);
+        void (*h)(int) = vp->handlers[sig];
+
+        vp->pending &= ~(1U << sig);
+
+        if (SIG_DFL == h) {
+
+            // Root is the real process, it dies the real way
+
+            if (!vp->parent && sig != SIGCHLD) {
+                signal(sig, SIG_DFL);
+                raise(sig);
+            } else if (sig != SIGCHLD) {
+                vp_exit();
+            }
+        } else if (SIG_IGN != h) {
+            h(sig);
+        }
+    }
+}
+
+// Makes signal pending in vp, ignored ones are dropped right away. Caught
+// signal interrupts sleeping or waiting target, sender gets its own
+// signals before kill returns like with the real kill
+
+static inline void vp_post(struct vproc * vp, int sig) {
+
+    if (sig <= 0 || sig >= VP_NSIG || SIG_IGN == vp->handlers[sig] || VP_ZOMBIE == vp->state) {
+        return;
+    }
+
+    vp->pending |= 1U << sig;
+
+    if (VP_SLEEPING == vp->state || VP_WAITING == vp->state || VP_FUTEX == vp->state) {
+        vp->interrupted = 1;
+        vp->sleep_token++;
+        vp_make_ready(vp);
+    } else if (vp == vp_current) {
+        vp_deliver();
+    }
+}
+
+static inline void vp_trampoline(void) {
+    vp_deliver();
+    vp_current->fn(vp_current->arg);
+    vp_exit();
+}
+
+static inline struct vproc * vp_alloc(void) {
+
+    struct vproc * vp = calloc(1, sizeof(struct vproc));
+
+    if (!vp || (vp_private_size && !(vp->priv = malloc(vp_private_size)))) {
+        vp_die("out of memory");
+    }
+
+    vp_grow(&vp_table, &vp_table_cap, vp_table_size + 1, sizeof(struct vproc *));
+    vp_grow(&vp_pg_heads, &vp_pg_cap, vp_table_size + 1, sizeof(struct vproc *));
+
+    vp->pid = VP_PID_BASE + vp_table_size;
+    vp_pg_heads[vp_table_size] = NULL;
+    vp_table[vp_table_size++] = vp;
+    return vp;
+}
+
+static inline void vp_pg_join(struct vproc * vp, pid_t pgid) {
+
+    struct vproc ** head = &vp_pg_heads[pgid - VP_PID_BASE];
+
+    vp->pgid = pgid;
+    vp->pg_prev = NULL;
+    vp->pg_next = *head;
+
+    if (*head) {
+        (*head)->pg_prev = vp;
+    }
+
+    *head = vp;
+}
+
+// Turns the calling process into virtual process VP_PID_BASE (it keeps
+// running on its own stack) and starts the scheduler context, on the
+// virtual clock when VTIME is set
+
+static inline void vp_init(void) {
+
+    static char * sched_stack;
+    struct vproc * root;
+
+    if (!(sched_stack = malloc(VP_SCHED_STACK_SIZE))) {
+        vp_die("out of memory");
+    }
+
+    vp_guard = sysconf(_SC_PAGESIZE);
+    vp_guards_left = 65530 / 4;
+
+    FILE * f = fopen("/proc/sys/vm/max_map_count", "r");
+
+    if (f) {
+        if (fscanf(f, "%ld", &vp_guards_left) == 1) {
+            vp_guards_left /= 4;
+        }
+        fclose(f);
+    }
+
+    if (getcontext(&vp_sched_ctx) < 0) {
+        vp_die("getcontext failed");
+    }
+
+    vp_sched_ctx.uc_stack.ss_sp = sched_stack;
+    vp_sched_ctx.uc_stack.ss_size = VP_SCHED_STACK_SIZE;
+    vp_sched_ctx.uc_link = NULL;
+    makecontext(&vp_sched_ctx, vp_schedule, 0);
+
+    root = vp_alloc();
+    vp_pg_join(root, root->pid);
+    root->state = VP_RUNNING;
+    vp_current = root;
+
+    if (vt_enabled()) {
+        vt_start();
+    }
+}
+
+// Counterpart of fork: child starts in fn(arg) once the scheduler gets to
+// it, inheriting dispositions, process group and private variables
+
+static inline pid_t vp_spawn(void (*fn)(void *), void * arg) {
+
+    struct vproc * vp = vp_alloc();
+
+    vp->parent = vp_current;
+    vp->fn = fn;
+    vp->arg = arg;
+    vp->stack = vp_stack_alloc();
+    memcpy(vp->handlers, vp_current->handlers, sizeof(vp->handlers));
+    vp_save_private(vp);
+    vp_pg_join(vp, vp_current->pgid);
+    vp_current->children++;
+
+    if (getcontext(&vp->ctx) < 0) {
+        vp_die("getcontext failed");
+    }
+
+    vp->ctx.uc_stack.ss_sp = (char *) vp->stack + vp_guard;
+    vp->ctx.uc_stack.ss_size = VP_STACK_SIZE - vp_guard;
+    vp->ctx.uc_link = NULL;
+    makecontext(&vp->ctx, vp_trampoline, 0);
+    vp_make_ready(vp);
+    return vp->pid;
+}
+
+static inline struct vproc * vp_find(pid_t pid) {
+
+    if (pid < VP_PID_BASE || pid >= VP_PID_BASE + vp_table_size) {
+        return NULL;
+    }
+
+    return vp_table[pid - VP_PID_BASE];
+}
+
+static inline int vp_group_exists(pid_t pgid) {
+    return pgid >= VP_PID_BASE && pgid < VP_PID_BASE + vp_table_size && vp_pg_heads[pgid - VP_PID_BASE];
+}
+
+static inline pid_t vp_getpid(void) {
+    return vp_current ? vp_current->pid : getpid();
+}
+
+static inline void (*vp_signal(int sig, void (*handler)(int)))(int) {
+
+    if (!vp_current) {
+        return signal(sig, handler);
+    }
+
+    if (sig <= 0 || sig >= VP_NSIG) {
+        errno = EINVAL;
+        return SIG_ERR;
+    }
+
+    void (*old)(int) = vp_current->handlers[sig];
+
+    vp_current->handlers[sig] = handler;
+    return old;
+}
+
+// pid > 0 one process, 0 own group, < -1 group -pid
+
+static inline int vp_kill(pid_t pid, int sig) {
+
+    if (!vp_current) {
+        return kill(pid, sig);
+    }
+
+    if (pid > 0) {
+
+        struct vproc * vp = vp_find(pid);
+
+        if (!vp || VP_ZOMBIE == vp->state) {
+            errno = ESRCH;
+            return -1;
+        }
+
+        vp_post(vp, sig);
+        return 0;
+    }
+
+    pid_t pgid = pid ? -pid : vp_current->pgid;
+
+    if (!vp_group_exists(pgid)) {
+        errno = ESRCH;
+        return -1;
+    }
+
+    // Sender is handled last, its handler may terminate it
+
+    int self = 0;
+
+    for (struct vproc * vp = vp_pg_heads[pgid - VP_PID_BASE]; vp; vp = vp->pg_next) {
+        if (vp == vp_current) {
+            self = 1;
+        } else {
+            vp_post(vp, sig);
+        }
+    }
+
+    if (self) {
+        vp_post(vp_current, sig);
+    }
+
+    return 0;
+}
+
+static inline int vp_killpg(pid_t pgid, int sig) {
+    return vp_current ? vp_kill(-pgid, sig) : killpg(pgid, sig);
+}
+
+static inline int vp_setpgid(pid_t pid, pid_t pgid) {
+
+    if (!vp_current) {
+        return setpgid(pid, pgid);
+    }
+
+    struct vproc * vp = pid ? vp_find(pid) : vp_current;
+
+    if (!vp || VP_ZOMBIE == vp->state) {
+        errno = ESRCH;
+        return -1;
+    }
+
+    if (!pgid) {
+        pgid = vp->pid;
+    }
+
+    if (pgid != vp->pid && !vp_group_exists(pgid)) {
+        errno = EPERM;
+        return -1;
+    }
+
+    if (vp->pg_prev) {
+        vp->pg_prev->pg_next = vp->pg_next;
+    } else {
+        vp_pg_heads[vp->pgid - VP_PID_BASE] = vp->pg_next;
+    }
+
+    if (vp->pg_next) {
+        vp->pg_next->pg_prev = vp->pg_prev;
+    }
+
+    vp_pg_join(vp, pgid);
+    return 0;
+}
+
+// Same contract as nanosleep: -1 with EINTR and time left in rem when a
+// caught signal interrupted the sleep
+
+static inline int vp_nanosleep(const struct timespec * req, struct timespec * rem) {
+
+    if (!vp_current) {
+        return nanosleep(req, rem);
+    }
+
+    struct vproc * vp = vp_current;
+
+    vp->wake_ns = vp_now() + req->tv_sec * 1000000000LL + req->tv_nsec;
+    vp->interrupted = 0;
+    vp_timer_add(vp, vp->wake_ns, VP_TIMER_WAKE, ++vp->sleep_token);
+    vp_block(VP_SLEEPING);
+
+    if (vp->interrupted) {
+
+        long long left = vp->wake_ns - vp_now();
+
+        if (left < 0) {
+            left = 0;
+        }
+
+        if (rem) {
+            rem->tv_sec = left / 1000000000LL;
+            rem->tv_nsec = left % 1000000000LL;
+        }
+
+        errno = EINTR;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Returns unslept seconds rounded like glibc sleep does
+
+static inline unsigned int vp_sleep(unsigned int seconds) {
+
+    if (!vp_current) {
+        return sleep(seconds);
+    }
+
+    struct timespec req = {seconds, 0}, rem;
+
+    if (vp_nanosleep(&req, &rem) < 0) {
+        return rem.tv_sec + (rem.tv_nsec >= 500000000L);
+    }
+
+    return 0;
+}
+
+static inline unsigned int vp_alarm(unsigned int seconds) {
+
+    if (!vp_current) {
+        return alarm(seconds);
+    }
+
+    struct vproc * vp = vp_current;
+    long long now = vp_now();
+    unsigned int left = vp->alarm_ns ? (vp->alarm_ns - now + 999999999LL) / 1000000000LL : 0;
+
+    vp->alarm_token++;
+    vp->alarm_ns = 0;
+
+    if (seconds) {
+        vp->alarm_ns = now + seconds * 1000000000LL;
+        vp_timer_add(vp, vp->alarm_ns, VP_TIMER_ALARM, vp->alarm_token);
+    }
+
+    return left;
+}
+
+// Reaps one terminated child, blocks while there is none unless WNOHANG
+// is given (then returns 0). pid has to be -1 or 0, both mean any child.
+// -1 with ECHILD when there are no children, with EINTR when a caught
+// signal came
+
+static inline pid_t vp_waitpid(pid_t pid, int * status, int options) {
+
+    if (!vp_current) {
+        return waitpid(pid, status, options);
+    }
+
+    struct vproc * vp = vp_current;
+
+    if (pid > 0 || pid < -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (!vp->zombies) {
+
+        if (!vp->children) {
+            errno = ECHILD;
+            return -1;
+        }
+
+        if (options & WNOHANG) {
+            return 0;
+        }
+
+        vp->interrupted = 0;
+        vp_block(VP_WAITING);
+
+        if (vp->interrupted && !vp->zombies) {
+            errno = EINTR;
+            return -1;
+        }
+    }
+
+    struct vproc * z = vp->zombies;
+
+    pid = z->pid;
+    vp->zombies = z->zombie_next;
+    vp->children--;
+
+    if (status) {
+        *status = 0;
+    }
+
+    // Slot stays in the table so pids are never reused
+
+    vp_table[pid - VP_PID_BASE] = NULL;
+    free(z->priv);
+    free(z);
+    return pid;
+}
+
+static inline pid_t vp_wait(int * status) {
+    return vp_current ? vp_waitpid(-1, status, 0) : wait(status);
+}
+
+// Same contract as FUTEX_WAIT with relative timeout (NULL waits forever):
+// -1 with EAGAIN when *uaddr isn't val, ETIMEDOUT or EINTR, 0 when woken
+
+static inline int vp_futex_wait(void * uaddr, unsigned int val, const struct timespec * timeout) {
+
+    if (!vp_current) {
+        return syscall(SYS_futex, uaddr, FUTEX_WAIT, val, timeout, NULL, 0);
+    }
+
+    struct vproc * vp = vp_current;
+
+    if (__atomic_load_n((unsigned int *) uaddr, __ATOMIC_SEQ_CST) != val) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    vp->futex_addr = uaddr;
+    vp->fx_prev = NULL;
+    vp->fx_next = vp_futex_waiters;
+
+    if (vp_futex_waiters) {
+        vp_futex_waiters->fx_prev = vp;
+    }
+
+    vp_futex_waiters = vp;
+    vp->interrupted = 0;
+    ++vp->sleep_token;
+
+    if (timeout) {
+        vp_timer_add(vp, vp_now() + timeout->tv_sec * 1000000000LL + timeout->tv_nsec,
+                     VP_TIMER_WAKE, vp->sleep_token);
+    }
+
+    vp_block(VP_FUTEX);
+
+    // Still on the list: timer or signal woke us, not vp_futex_wake
+
+    if (vp->futex_addr) {
+        vp_futex_unlink(vp);
+        errno = vp->interrupted ? EINTR : ETIMEDOUT;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Wakes up to n waiters of uaddr, returns how many were woken
+
+static inline int vp_futex_wake(void * uaddr, int n) {
+
+    if (!vp_current) {
+        return syscall(SYS_futex, uaddr, FUTEX_WAKE, n, NULL, NULL, 0);
+    }
+
+    int woken = 0;
+
+    for (struct vproc * vp = vp_futex_waiters, * next; vp && woken < n; vp = next) {
+
+        next = vp->fx_next;
+
+        if (vp->futex_addr == uaddr) {
+            vp_futex_unlink(vp);
+            vp->sleep_token++;
+            vp_make_ready(vp);
+            woken++;
+        }
+    }
+
+    return woken;
+}
+
+#endif
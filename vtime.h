@@ -0,0 +1,78 @@
+#ifndef VTIME_H
+#define VTIME_H
+
+// Virtual clock for simulation mode of the sleep-based labs. Programs run
+// their own code on the vproc engine (vproc.h), but sleeps and alarms don't
+// take real time: whenever every virtual process is blocked, the clock
+// jumps to the earliest timer. Work between two sleeps takes no virtual
+// time and timers due at the same time fire in the order they were set,
+// so a run is fully deterministic.
+//
+// Simulation is switched on with VTIME environment variable, the same way
+// PACE chooses pacing mode, so programs keep their arguments.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define VT_SEC 1000000000LL
+
+// Clock starts at one second, so seeds taken from time() still differ
+// between virtual pids
+
+#define VT_EPOCH VT_SEC
+
+static int vt_on = 0;
+static long long vt_clock = VT_EPOCH;
+static long long vt_jumps = 0;
+static long long vt_wall_start = 0;
+
+static inline int vt_enabled(void) {
+    return getenv("VTIME") != NULL;
+}
+
+static inline int vt_active(void) {
+    return vt_on;
+}
+
+static inline long long vt_now(void) {
+    return vt_clock;
+}
+
+static inline long long vt_wall(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * VT_SEC + ts.tv_nsec;
+}
+
+static inline void vt_summary(void) {
+    fprintf(stderr, "[VTIME] %lld clock jumps, %.3f s virtual in %.3f ms real\n",
+            vt_jumps, (double) (vt_clock - VT_EPOCH) / VT_SEC, (vt_wall() - vt_wall_start) / 1e6);
+}
+
+// Called by the engine when it starts, summary of the run goes to stderr
+// at exit
+
+static inline void vt_start(void) {
+
+    vt_on = 1;
+    vt_wall_start = vt_wall();
+
+    if (atexit(vt_summary)) {
+        perror("atexit");
+    }
+}
+
+// Clock only moves forward
+
+static inline void vt_advance(long long t) {
+
+    if (t > vt_clock) {
+        vt_clock = t;
+        vt_jumps++;
+    }
+}
+
+#endif